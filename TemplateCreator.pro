@@ -16,14 +16,24 @@ SOURCES += main.cpp\
     qcustomplot.cpp \
     heka.cpp \
     fft.cpp \
-    numerics.cpp
+    numerics.cpp \
+    batch.cpp \
+    templatecache.cpp \
+    expression.cpp \
+    smoothing.cpp \
+    analysis.cpp
 
 HEADERS  += mainwindow.h \
     qcustomplot.h \
     fft.h \
     heka.h \
     numerics.h \
-    debug.h
+    debug.h \
+    batch.h \
+    templatecache.h \
+    expression.h \
+    smoothing.h \
+    analysis.h
 
 FORMS    += mainwindow.ui
 
@@ -0,0 +1,434 @@
+/*****************************************************************************************************************
+
+    Sweep Analysis: spike detection, spike triggered averages, statistics, alignment and impedance of recorded sweeps
+
+    Author: Christoph Kirst (ckirst@nld.ds.mpg.de)
+    Date:   2012, LMU Munich
+
+ *****************************************************************************************************************/
+
+#include "analysis.h"
+
+#include "fft.h"
+#include "smoothing.h"
+
+#include <QTime>
+
+#include <algorithm>
+#include <cmath>
+
+static const double pi = 3.141592653589793;
+
+
+/*****************************************************************************************************************
+ *
+ *      Spike Detection
+ *
+ *****************************************************************************************************************/
+
+// samples tested at once for a crossing
+static const int spike_block = 256;
+
+void detect_spikes(const DataVIEW& v, DataTYPE threshold, DataTYPE slope, int refractory, std::vector<int>& spikes) {
+    spikes.clear();
+    int n = v.size();
+    const DataTYPE* x = v.begin();
+    int last = -refractory - 1;
+
+    for (int b = 1; b < n; b += spike_block) {
+        int e = std::min(b + spike_block, n);
+
+        int hit = 0;
+        for (int i = b; i < e; i++) hit |= (x[i-1] < threshold) & (x[i] >= threshold) & (x[i] - x[i-1] >= slope);
+        if (!hit) continue;
+
+        for (int i = b; i < e; i++) {
+            if (x[i-1] < threshold && x[i] >= threshold && x[i] - x[i-1] >= slope && i - last > refractory) {
+                spikes.push_back(i);
+                last = i;
+            }
+        }
+    }
+}
+
+
+/*****************************************************************************************************************
+ *
+ *      Spike Triggered Average
+ *
+ *****************************************************************************************************************/
+
+SpikeTriggeredAverage::SpikeTriggeredAverage(const DataVECTOR& s, int before, int after)
+    : stimulus(s), nbefore(std::max(before, 0)), nafter(std::max(after, 1)), nspikes(0), nsweeps(0) {
+    sum.resize(nbefore + nafter, 0.0);
+}
+
+void SpikeTriggeredAverage::reset() {
+    std::fill(sum.begin(), sum.end(), 0.0);
+    nspikes = 0;
+    nsweeps = 0;
+}
+
+int SpikeTriggeredAverage::add(const DataVIEW& response, DataTYPE threshold, DataTYPE slope, int refractory) {
+    detect_spikes(response, threshold, slope, refractory, pos);
+    nsweeps++;
+
+    int n = int(stimulus.size());
+    int m = int(sum.size());
+    int added = 0;
+    for (int k = 0; k < int(pos.size()); k++) {
+        int a = pos[k] - nbefore;
+        if (a < 0 || a + m > n) continue;
+
+        const DataTYPE* s = &stimulus[a];
+        for (int j = 0; j < m; j++) sum[j] += s[j];
+        added++;
+    }
+
+    nspikes += added;
+    return added;
+}
+
+void SpikeTriggeredAverage::average(DataVECTOR& sta) const {
+    sta.resize(sum.size());
+    for (int j = 0; j < int(sum.size()); j++) sta[j] = nspikes > 0 ? sum[j] / nspikes : 0;
+}
+
+
+/*****************************************************************************************************************
+ *
+ *      Alignment
+ *
+ *****************************************************************************************************************/
+
+bool align_sweeps(const DataVIEW& stimulus, const DataVIEW& response, int max_lag, Alignment& a, int max_samples) {
+    AlignmentWorkspace w;
+    return align_sweeps(stimulus, response, max_lag, a, w, max_samples);
+}
+
+bool align_sweeps(const DataVIEW& stimulus, const DataVIEW& response, int max_lag, Alignment& a,
+                  AlignmentWorkspace& w, int max_samples) {
+    a.valid = false;
+    int n = std::min(std::min(stimulus.size(), response.size()), max_samples);
+    if (max_lag < 1) max_lag = 1;
+    if (max_lag > n / 2) max_lag = n / 2;
+    if (n < 8 || max_lag < 1) return false;
+
+    // zero padded by max_lag so that the lags searched do not wrap around
+    int m = find_good_larger_fft_size(n + max_lag);
+    if (w.plan.size() != m) w.plan.setup(m);
+
+    double mx = 0, my = 0;
+    for (int i = 0; i < n; i++) {
+        mx += stimulus[i];
+        my += response[i];
+    }
+    mx /= n;
+    my /= n;
+
+    // both real signals in one complex transform: z = x + i y
+    std::vector<double>& zr = w.zr, & zi = w.zi, & fr = w.fr, & fi = w.fi;
+    zr.assign(m, 0.0);
+    zi.assign(m, 0.0);
+    fr.resize(m);
+    fi.resize(m);
+    double sxx = 0, syy = 0;
+    for (int i = 0; i < n; i++) {
+        zr[i] = stimulus[i] - mx;
+        zi[i] = response[i] - my;
+        sxx += zr[i] * zr[i];
+        syy += zi[i] * zi[i];
+    }
+    if (sxx <= 0 || syy <= 0) return false;
+
+    w.plan.execute(&zr[0], &zi[0], &fr[0], &fi[0]);
+
+    // X = (Z_k + conj Z_-k) / 2, Y = (Z_k - conj Z_-k) / 2i, cross spectrum conj(X) Y, conjugated for the inverse
+    for (int k = 0; k < m; k++) {
+        int j = k == 0 ? 0 : m - k;
+        double xr = (fr[k] + fr[j]) / 2, xi = (fi[k] - fi[j]) / 2;
+        double yr = (fi[k] + fi[j]) / 2, yi = (fr[j] - fr[k]) / 2;
+        zr[k] = xr * yr + xi * yi;
+        zi[k] = -(xr * yi - xi * yr);
+    }
+    w.plan.execute(&zr[0], &zi[0], &fr[0], &fi[0]);
+
+    // fr[k] is m times the correlation at lag k, negative lags wrap to the end
+    int best = 0;
+    double rbest = -1;
+    for (int k = -max_lag; k <= max_lag; k++) {
+        double r = fabs(fr[(k + m) % m]);
+        if (r > rbest) {
+            rbest = r;
+            best = k;
+        }
+    }
+
+    a.lag = best;
+    a.delay = best;
+    if (best > -max_lag && best < max_lag) {
+        double r0 = fabs(fr[(best - 1 + m) % m]), r1 = rbest, r2 = fabs(fr[(best + 1 + m) % m]);
+        double c = r0 - 2 * r1 + r2;
+        if (c < 0) a.delay += 0.5 * (r0 - r2) / c;
+    }
+    a.correlation = fr[(best + m) % m] / m / sqrt(sxx * syy);
+    a.valid = true;
+    return true;
+}
+
+
+// half length of the fractional delay filter
+static const int delay_taps = 8;
+
+void fractional_delay(const DataVIEW& x, double shift, DataVECTOR& y) {
+    int n = x.size();
+    y.resize(n);
+    if (n == 0) return;
+
+    // blackman windowed sinc at the offsets j - shift, normalized to unit gain
+    double h[2 * delay_taps];
+    double sum = 0;
+    for (int j = -delay_taps + 1; j <= delay_taps; j++) {
+        double t = j - shift;
+        double s = fabs(t) < 1e-12 ? 1.0 : sin(pi * t) / (pi * t);
+        double w = 0.42 + 0.5 * cos(pi * t / delay_taps) + 0.08 * cos(2 * pi * t / delay_taps);
+        h[j + delay_taps - 1] = fabs(t) < delay_taps ? s * w : 0.0;
+        sum += h[j + delay_taps - 1];
+    }
+    for (int j = 0; j < 2 * delay_taps; j++) h[j] /= sum;
+
+    const DataTYPE* d = x.begin();
+    for (int i = 0; i < n; i++) {
+        double v = 0;
+        if (i >= delay_taps - 1 && i + delay_taps < n) {
+            const DataTYPE* p = d + i - delay_taps + 1;
+            for (int j = 0; j < 2 * delay_taps; j++) v += h[j] * p[j];
+        } else {
+            for (int j = 0; j < 2 * delay_taps; j++) {
+                int k = std::min(std::max(i + j - delay_taps + 1, 0), n - 1);
+                v += h[j] * d[k];
+            }
+        }
+        y[i] = v;
+    }
+}
+
+
+/*****************************************************************************************************************
+ *
+ *      Sweep Statistics
+ *
+ *****************************************************************************************************************/
+
+// samples per parallel task
+static const int statistics_block = 1 << 16;
+
+// one Welford step of sweep number n for the samples of a block
+class SweepStatistics::UpdateTask : public BlockTask {
+public:
+    UpdateTask(SweepStatistics& s, const DataTYPE* x) : st(s), x(x) {}
+
+    void block(int b) {
+        int i0 = b * statistics_block;
+        int i1 = std::min(i0 + statistics_block, st.size());
+        double inv = 1.0 / st.n;
+        double* m = &st.m[0];
+        double* m2 = &st.m2[0];
+        DataTYPE* lo = &st.lo[0];
+        DataTYPE* hi = &st.hi[0];
+
+        for (int i = i0; i < i1; i++) {
+            double d = x[i] - m[i];
+            m[i] += d * inv;
+            m2[i] += d * (x[i] - m[i]);
+            lo[i] = std::min(lo[i], x[i]);
+            hi[i] = std::max(hi[i], x[i]);
+        }
+    }
+
+private:
+    SweepStatistics& st;
+    const DataTYPE* x;
+};
+
+void SweepStatistics::reset() {
+    n = 0;
+    m.clear();
+    m2.clear();
+    lo.clear();
+    hi.clear();
+}
+
+bool SweepStatistics::add(const DataVIEW& sweep, bool parallel) {
+    if (n == 0) {
+        int k = sweep.size();
+        m.assign(sweep.begin(), sweep.end());
+        m2.assign(k, 0.0);
+        lo.assign(sweep.begin(), sweep.end());
+        hi.assign(sweep.begin(), sweep.end());
+        n = 1;
+        return true;
+    }
+
+    if (sweep.size() < size()) return false;
+
+    n++;
+    UpdateTask task(*this, sweep.begin());
+    run_blocks(task, (size() + statistics_block - 1) / statistics_block, parallel);
+    return true;
+}
+
+void SweepStatistics::mean(DataVECTOR& v) const {
+    v.assign(m.begin(), m.end());
+}
+
+void SweepStatistics::variance(DataVECTOR& v) const {
+    v.resize(m2.size());
+    double norm = n > 1 ? 1.0 / (n - 1) : 0.0;
+    for (int i = 0; i < int(m2.size()); i++) v[i] = m2[i] * norm;
+}
+
+void SweepStatistics::sd(DataVECTOR& v) const {
+    variance(v);
+    for (int i = 0; i < int(v.size()); i++) v[i] = sqrt(v[i]);
+}
+
+
+
+/*****************************************************************************************************************
+ *
+ *      Resonance Pipeline
+ *
+ *****************************************************************************************************************/
+
+ResonancePipeline::ResonancePipeline() : length0(0), length1(0), offset1(0), offset2(0), reused(false), df_(1.0),
+                                         smooth_df(1.0) {
+    for (int s = 0; s < NStages; s++) timing[s] = 0;
+}
+
+const char* ResonancePipeline::stage_name(Stage stage) {
+    static const char* names[NStages] = {"equalize", "trim", "align", "truncate", "spectrum", "crop",
+                                         "smooth", "peaks", "fit"};
+    return names[stage];
+}
+
+bool ResonancePipeline::analyze() {
+    QTime t;
+    t.start();
+    equalize();
+    timing[Equalize] = t.restart();
+    trim();
+    timing[Trim] = t.restart();
+    align();
+    timing[Align] = t.restart();
+    truncate();
+    timing[Truncate] = t.restart();
+    spectrum();
+    timing[Spectrum] = t.restart();
+    crop();
+    timing[Crop] = t.restart();
+
+    return !imp_view.empty();
+}
+
+bool ResonancePipeline::smooth() {
+    if (imp_view.empty()) return false;
+
+    QTime t;
+    t.start();
+    smooth_impedance();
+    timing[Smooth] = t.restart();
+    peaks();
+    timing[Peaks] = t.restart();
+    bool suc = fit();
+    timing[Fit] = t.restart();
+    return suc;
+}
+
+
+void ResonancePipeline::equalize() {
+    stim_view = DataVIEW(stim);
+    resp_view = DataVIEW(resp);
+    length0 = stim_view.size();
+    length1 = resp_view.size();
+
+    if (length0 < length1) remove_ends(resp_view, 0, length1 - length0);
+    if (length0 > length1) remove_ends(stim_view, 0, length0 - length1);
+}
+
+void ResonancePipeline::trim() {
+    offset1 = 0;
+    offset2 = 0;
+    first_non_zero(stim_view, offset1, DataTYPE(settings.zero), DataTYPE(settings.tolerance));
+    last_non_zero(stim_view, offset2, DataTYPE(settings.zero), DataTYPE(settings.tolerance));
+
+    remove_ends(stim_view, offset1, offset2);
+    remove_ends(resp_view, offset1, offset2);
+}
+
+// integer lag by trimming, the fraction by interpolation
+void ResonancePipeline::align() {
+    alignment_ = Alignment();
+    if (settings.max_lag <= 0) return;
+    if (!align_sweeps(stim_view, resp_view, settings.max_lag, alignment_, align_workspace)) return;
+
+    int lag = alignment_.lag;
+    if (lag > 0) {
+        remove_ends(resp_view, lag, 0);
+        remove_ends(stim_view, 0, lag);
+    } else if (lag < 0) {
+        remove_ends(stim_view, -lag, 0);
+        remove_ends(resp_view, 0, -lag);
+    }
+    fractional_delay(resp_view, alignment_.delay - lag, resp_aligned);
+    resp_view = DataVIEW(resp_aligned);
+}
+
+void ResonancePipeline::truncate() {
+    int n = stim_view.size();
+    int m = n > 0 ? find_good_smaller_fft_size(n) : 0;
+    remove_ends(stim_view, 0, n - m);
+    remove_ends(resp_view, 0, n - m);
+}
+
+// the stimulus is only transformed again if it changed
+void ResonancePipeline::spectrum() {
+    // bins are 1 / (n dt) apart for the n samples left after trimming and truncating, not 1 / dur
+    int n = stim_view.size();
+    if (settings.sample > 0 && n > 0) df_ = settings.sample * 1000.0 / n;
+    else df_ = 1.0 / settings.dur;
+
+    reused = !impedance_spectrum.set_stimulus(stim_view);
+    impedance_spectrum.response(resp_view, magnitude, phases);
+
+    // squared magnitude for smoothing, peaks and fit
+    imp.resize(magnitude.size());
+    for (int i = 0; i < int(magnitude.size()); i++) imp[i] = magnitude[i] * magnitude[i];
+}
+
+// zoom into the frequencies of the zap: up to fmax with the bin spacing of the spectrum
+void ResonancePipeline::crop() {
+    int nf = int(imp.size());
+    int first = std::min(settings.first, nf);
+    int np = int(settings.fmax / df_);
+    if (np > nf - first) np = nf - first;
+    if (np < 0) np = 0;
+
+    imp_view = DataVIEW(imp);
+    phase_view = DataVIEW(phases);
+    remove_ends(imp_view, first, nf - np - first);
+    remove_ends(phase_view, first, nf - np - first);
+}
+
+void ResonancePipeline::smooth_impedance() {
+    smooth_df = df_ * ::smooth(imp_view, settings.window, settings.width, imp_smooth);
+}
+
+void ResonancePipeline::peaks() {
+    find_peaks(imp_smooth, DataTYPE(settings.peak), peak_pos, settings.max_peaks);
+}
+
+// starts from the last fit, e.g. of the last cell
+bool ResonancePipeline::fit() {
+    return fit_resonance(imp_view, first_frequency(), df_, fit_);
+}
@@ -0,0 +1,220 @@
+/*****************************************************************************************************************
+
+    Sweep Analysis: spike detection, spike triggered averages, statistics, alignment and impedance of recorded sweeps
+
+    Author: Christoph Kirst (ckirst@nld.ds.mpg.de)
+    Date:   2012, LMU Munich
+
+ *****************************************************************************************************************/
+
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <vector>
+
+#include "numerics.h"
+
+
+/*! detects spikes in \param v as upward crossings of \param threshold that rise by at least \param slope from the
+ *  previous sample, at least \param refractory samples apart, and stores their positions in \param spikes.
+ *  Blocks without a crossing are skipped by a branch free test.
+ */
+void detect_spikes(const DataVIEW& v, DataTYPE threshold, DataTYPE slope, int refractory, std::vector<int>& spikes);
+
+
+/*! Spike triggered average of a frozen \param stimulus over the sweeps recorded with it. Each sweep is added
+ *  once after it is recorded and not kept, memory is the stimulus and one window of \param before + \param after
+ *  samples around the spikes.
+ */
+class SpikeTriggeredAverage {
+public:
+    SpikeTriggeredAverage(const DataVECTOR& stimulus, int before, int after);
+
+    void reset();
+
+    /*! detects the spikes in \param response, see \ref detect_spikes, and adds the stimulus around them.
+     *  Spikes whose window does not fit into the stimulus are skipped. Returns the number of spikes added
+     */
+    int add(const DataVIEW& response, DataTYPE threshold, DataTYPE slope = 0, int refractory = 0);
+
+    int spikes() const { return nspikes; }
+    int sweeps() const { return nsweeps; }
+    int before() const { return nbefore; }
+
+    /*! the average stimulus, sample i at i - \ref before samples relative to the spike */
+    void average(DataVECTOR& sta) const;
+
+private:
+    DataVECTOR stimulus;
+    int nbefore, nafter;
+    std::vector<double> sum;
+    int nspikes, nsweeps;
+    std::vector<int> pos;
+};
+
+
+/*! Result of \ref align_sweeps: the response lags the stimulus by \ref delay = \ref lag + fraction samples
+ */
+struct Alignment {
+    int lag;            // integer lag at the correlation maximum
+    double delay;       // lag refined by a parabola through the maximum and its neighbours
+    double correlation; // correlation coefficient at the maximum, negative for inverted responses
+    bool valid;
+
+    Alignment() : lag(0), delay(0), correlation(0), valid(false) {}
+};
+
+/*! fft plan and buffers of \ref align_sweeps, reused as long as the correlation length does not change
+ */
+struct AlignmentWorkspace {
+    FFTPlan plan;
+    std::vector<double> zr, zi, fr, fi;
+};
+
+/*! finds the latency of \param response to \param stimulus as the maximum of |cross correlation| within
+ *  +- \param max_lag samples, computed by fft over at most \param max_samples samples from the start.
+ *  Both means are removed first. Returns false if the data are too short or constant.
+ */
+bool align_sweeps(const DataVIEW& stimulus, const DataVIEW& response, int max_lag, Alignment& a,
+                  int max_samples = 1 << 17);
+bool align_sweeps(const DataVIEW& stimulus, const DataVIEW& response, int max_lag, Alignment& a,
+                  AlignmentWorkspace& w, int max_samples = 1 << 17);
+
+/*! \param y [i] = \param x (i + \param shift), interpolated with a windowed sinc for fractional shifts |shift| < 1
+ *  and continued with the end samples, e.g. to advance a response by the fraction of \ref Alignment::delay
+ */
+void fractional_delay(const DataVIEW& x, double shift, DataVECTOR& y);
+
+
+/*! Per sample statistics over repeated sweeps: mean, variance, minimum and maximum of each sample, updated
+ *  sweep by sweep with Welford's algorithm so only O(samples) memory is used. The length is that of the first
+ *  sweep, longer sweeps are cut, shorter ones rejected. Long sweeps are updated on several threads.
+ */
+class SweepStatistics {
+public:
+    SweepStatistics() : n(0) {}
+
+    void reset();
+
+    /*! adds \param sweep, returns false if it is shorter than the first sweep */
+    bool add(const DataVIEW& sweep, bool parallel = true);
+
+    int count() const { return n; }
+    int size() const { return int(m.size()); }
+
+    void mean(DataVECTOR& v) const;
+    /*! sample variance (n-1 normalization), 0 for a single sweep */
+    void variance(DataVECTOR& v) const;
+    void sd(DataVECTOR& v) const;
+    void min(DataVECTOR& v) const { v = lo; }
+    void max(DataVECTOR& v) const { v = hi; }
+
+private:
+    class UpdateTask;
+
+    int n;
+    std::vector<double> m, m2;
+    DataVECTOR lo, hi;
+};
+
+
+/*! Impedance analysis of a zap sweep as done by runResonance, split into stages: the stimulus and response are
+ *  equalized in length, trimmed to the zap (\ref first_non_zero, \ref last_non_zero), aligned
+ *  (\ref align_sweeps), truncated to a good fft size, transformed (\ref ImpedanceSpectrum), cropped to the
+ *  frequencies of the zap, smoothed (\ref smooth), searched for peaks (\ref find_peaks) and fitted
+ *  (\ref fit_resonance). All buffers are members and keep their capacity, so repeated scans with the same
+ *  protocol do not allocate except for the smoothing scratch. The stages can also be called one by one,
+ *  each records its duration.
+ */
+class ResonancePipeline {
+public:
+    enum Stage {Equalize = 0, Trim, Align, Truncate, Spectrum, Crop, Smooth, Peaks, Fit, NStages};
+
+    struct Settings {
+        double zero, tolerance; // level and tolerance of the stimulus outside the zap
+        int max_lag;            // [samples], 0 for no alignment
+        double dur, fmax;       // zap duration [sec], bin spacing 1 / dur without sample, and highest frequency [Hz]
+        double sample;          // sampling rate [kHz]
+        int first;              // first frequency bin kept
+        int window, width;      // smoothing, see \ref smooth
+        double peak;            // peak threshold of \ref find_peaks
+        int max_peaks;
+
+        Settings() : zero(0), tolerance(0), max_lag(0), dur(1), fmax(50), sample(20), first(5), window(0), width(1),
+                     peak(1), max_peaks(100) {}
+    };
+
+    ResonancePipeline();
+
+    Settings settings;
+
+    /*! buffers to read the stimulus and response into, kept between runs */
+    DataVECTOR& stimulus_buffer() { return stim; }
+    DataVECTOR& response_buffer() { return resp; }
+
+    /*! runs \ref Equalize to \ref Crop on the buffers, returns false if no spectrum is left */
+    bool analyze();
+
+    /*! runs \ref Smooth to \ref Fit on the last impedance, e.g. again after the smoothing changed.
+     *  Returns false if the fit did not converge.
+     */
+    bool smooth();
+
+    void equalize();
+    void trim();
+    void align();
+    void truncate();
+    void spectrum();
+    void crop();
+    void smooth_impedance();
+    void peaks();
+    bool fit();
+
+    // results
+    int length_before() const { return length0; }   // samples of the stimulus and response before equalizing
+    int response_length_before() const { return length1; }
+    int length() const { return stim_view.size(); }  // samples analyzed after the last stage run
+    int offset_first() const { return offset1; }
+    int offset_last() const { return offset2; }
+    const Alignment& alignment() const { return alignment_; }
+    bool stimulus_reused() const { return reused; }
+
+    const DataVIEW& impedance() const { return imp_view; }     // squared impedance |Z|^2 from df * first on
+    const DataVIEW& phase() const { return phase_view; }
+    double df() const { return df_; }                          // bin spacing of the analyzed length [Hz]
+    double first_frequency() const { return df_ * settings.first; }
+
+    const DataVECTOR& smoothed() const { return imp_smooth; }
+    double smoothed_df() const { return smooth_df; }
+    const std::vector<int>& peak_positions() const { return peak_pos; }
+    const ResonanceFit& resonance_fit() const { return fit_; }
+
+    /*! duration of the last run of \param stage [ms] */
+    int time(Stage stage) const { return timing[stage]; }
+    static const char* stage_name(Stage stage);
+
+private:
+    DataVECTOR stim, resp;
+    DataVIEW stim_view, resp_view;
+    int length0, length1, offset1, offset2;
+
+    AlignmentWorkspace align_workspace;
+    Alignment alignment_;
+    DataVECTOR resp_aligned;
+
+    ImpedanceSpectrum impedance_spectrum;
+    bool reused;
+    DataVECTOR magnitude, phases, imp;
+    DataVIEW imp_view, phase_view;
+    double df_;
+
+    DataVECTOR imp_smooth;
+    double smooth_df;
+    std::vector<int> peak_pos;
+    ResonanceFit fit_;
+
+    int timing[NStages];
+};
+
+
+#endif // ANALYSIS_H
@@ -0,0 +1,287 @@
+/*****************************************************************************************************************
+
+    Batch Template Creation: many templates generated in parallel and written to disk
+
+    Author: Christoph Kirst (ckirst@nld.ds.mpg.de)
+    Date:   2012, LMU Munich
+
+ *****************************************************************************************************************/
+
+#include "batch.h"
+
+#include "debug.h"
+
+#include <QCoreApplication>
+#include <QRunnable>
+#include <QMutexLocker>
+#include <QThread>
+#include <QFileInfo>
+#include <QDir>
+
+#include <algorithm>
+#include <set>
+
+
+/*****************************************************************************************************************
+ *
+ *      Noise Batch
+ *
+ *****************************************************************************************************************/
+
+// chunk size of streamed templates
+static const int stream_chunk = 1 << 16;
+
+bool write_noise_stream(Heka* heka, const NoiseParameter& p, double int16_scale, DataVECTOR* preview, int npreview) {
+    std::fstream file;
+    if (!heka->open_template_file(p.file, file)) return false;
+
+    int nl, nr;
+    template_margins(p.sample, p.left, p.right, nl, nr);
+    nr += TEMPLATE_PADDING;
+    int nb = noise_length(p.dur, p.sample);
+
+    if (preview) preview->clear();
+
+    NoiseStream stream(p.sample, p.f, p.phase, p.amp, p.f0, p.f1, p.sigma, p.seed, p.off, &p.shape);
+    DataVECTOR chunk(stream_chunk);
+
+    // margins, body and padding in chunks
+    bool suc = true;
+    int part[3] = {nl, nb, nr};
+    for (int j = 0; j < 3 && suc; j++) {
+        for (int i = 0; i < part[j] && suc; i += stream_chunk) {
+            int k = std::min(stream_chunk, part[j] - i);
+            if (j == 1) stream.read(&chunk[0], k);
+            else std::fill(chunk.begin(), chunk.begin() + k, DataTYPE(p.off));
+
+            suc = heka->write_template_data(file, &chunk[0], k, int16_scale);
+
+            if (preview && int(preview->size()) < npreview) {
+                int m = std::min(k, npreview - int(preview->size()));
+                preview->insert(preview->end(), chunk.begin(), chunk.begin() + m);
+            }
+        }
+    }
+
+    heka->close_template_file(file);
+    return suc;
+}
+
+
+bool write_step_protocol(Heka* heka, const StepProtocol& steps, const QString& fname) {
+    std::fstream file;
+    if (!heka->open_template_file(fname, file)) return false;
+
+    DataTYPE last = 0;
+    if (!steps.segments().empty()) last = steps.segments().back().level + steps.segments().back().ramp;
+
+    DataVECTOR chunk(stream_chunk);
+    double int16_scale = heka->template_int16_scale(fname);
+    bool suc = true;
+    int n = steps.length();
+    for (int i = 0; i < n && suc; i += stream_chunk) {
+        int k = std::min(stream_chunk, n - i);
+        steps.expand(i, k, 0, &chunk[0]);
+        suc = heka->write_template_data(file, &chunk[0], k, int16_scale);
+    }
+
+    std::fill(chunk.begin(), chunk.begin() + TEMPLATE_PADDING, last);
+    if (suc) suc = heka->write_template_data(file, &chunk[0], TEMPLATE_PADDING, int16_scale);
+
+    heka->close_template_file(file);
+    return suc;
+}
+
+
+// the work done on the pool: fft, normalization and writing
+class NoiseBatch::Job : public QRunnable {
+public:
+    Job(NoiseBatch* b, const NoiseParameter& p, int s) : batch(b), par(p), slot(s) {}
+
+    void run() {
+        Slot* sl = batch->slots[slot];
+        DataVECTOR& v = sl->v;
+
+        if (par.stream) {
+            bool suc = write_noise_stream(batch->heka, par, batch->int16_scale(par.file), &v, NoiseBatch::preview_length);
+            batch->job_done(suc, noise_length(par.dur, par.sample));
+            batch->release_slot(slot);
+            return;
+        }
+
+        // noise is written directly between the margins of the final template
+        if (par.process != 0) {
+            // one template per worker already keeps the pool busy
+            DataTYPE* body = prepare_template(par.sample, par.off, par.left, par.right,
+                                              noise_length(par.dur, par.sample), TEMPLATE_PADDING, v);
+            if (par.process == 1) create_ou_noise(par.dur, par.sample, par.tau, par.sigma, par.seed, par.off, body, false);
+            else create_filtered_noise(par.dur, par.sample, par.f1, par.sigma, par.seed, par.off, body, false);
+        } else {
+            DataTYPE* body = prepare_template(par.sample, par.off, par.left, par.right, sl->workspace.n_final,
+                                              TEMPLATE_PADDING, v);
+            synthesize_noise(par.sample, par.f, par.phase, par.amp, par.sigma, par.off, sl->workspace, body);
+        }
+
+        double int16_scale = batch->int16_scale(par.file);
+        std::fstream file;
+        bool suc = batch->heka->open_template_file(par.file, file);
+        if (suc) {
+            suc = batch->heka->write_template_data(file, v.empty() ? 0 : &v[0], v.size(), int16_scale);
+            batch->heka->close_template_file(file);
+        }
+
+        if (suc && batch->cache && !par.key.isEmpty()) batch->cache->insert(par.key, v);
+
+        batch->job_done(suc, v.size());
+        batch->release_slot(slot);
+    }
+
+private:
+    NoiseBatch* batch;
+    NoiseParameter par;
+    int slot;
+};
+
+
+NoiseBatch::NoiseBatch(Heka* h, TemplateCache* c) : heka(h), cache(c), last_slot(-1), nfailed(0), ndone(0), nsamples(0),
+                                                    last_report(0) {
+    // the workers must not read the settings of heka, which the GUI may change meanwhile
+    int16_sequences = heka->int16_sequences;
+    int16_range = heka->int16_range;
+
+    // one slot more than threads so that the next spectrum can be drawn while all workers are busy
+    int nslots = QThread::idealThreadCount() + 1;
+    if (nslots < 2) nslots = 2;
+
+    for (int i = 0; i < nslots; i++) {
+        slots.push_back(new Slot);
+        free_list.push_back(i);
+    }
+    free_slots.release(nslots);
+}
+
+NoiseBatch::~NoiseBatch() {
+    pool.waitForDone();
+    for (int i = 0; i < int(slots.size()); i++) delete slots[i];
+}
+
+void NoiseBatch::add(const NoiseParameter& p) {
+    jobs.push_back(p);
+}
+
+const DataVECTOR& NoiseBatch::last() const {
+    static const DataVECTOR empty;
+    if (last_slot < 0) return empty;
+    return slots[last_slot]->v;
+}
+
+
+int NoiseBatch::acquire_slot(bool* break_execution) {
+    while (!free_slots.tryAcquire(1, 50)) {
+        report();
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 50);
+        if (break_execution && *break_execution) return -1;
+    }
+
+    QMutexLocker lock(&mutex);
+    int s = free_list.back();
+    free_list.pop_back();
+    return s;
+}
+
+void NoiseBatch::release_slot(int s) {
+    QMutexLocker lock(&mutex);
+    free_list.push_back(s);
+    free_slots.release();
+}
+
+double NoiseBatch::int16_scale(const QString& file) const {
+    return Heka::template_int16_scale(file, int16_sequences, int16_range);
+}
+
+void NoiseBatch::job_done(bool ok, qint64 n) {
+    QMutexLocker lock(&mutex);
+    if (!ok) nfailed++;
+    ndone++;
+    nsamples += n;
+}
+
+// emits progress at most every 250 ms unless forced
+void NoiseBatch::report(bool force) {
+    int ms = timer.elapsed();
+    if (!force && ms - last_report < 250) return;
+    last_report = ms;
+
+    int d;
+    qint64 ns;
+    {
+        QMutexLocker lock(&mutex);
+        d = ndone;
+        ns = nsamples;
+    }
+    double sec = std::max(ms, 1) / 1000.0;
+    emit progress(d, size(), d / sec, ns / sec);
+}
+
+
+bool NoiseBatch::run(bool* break_execution) {
+    DEBUG("NoiseBatch::run")
+
+    nfailed = 0;
+    ndone = 0;
+    nsamples = 0;
+    last_slot = -1;
+    timer.start();
+    last_report = 0;
+
+    //create directories if not existent, once for all jobs
+    std::set<QString> dirs;
+    for (int i = 0; i < int(jobs.size()); i++) dirs.insert(QFileInfo(jobs[i].file).path());
+    for (std::set<QString>::const_iterator it = dirs.begin(); it != dirs.end(); it++) QDir().mkpath(*it);
+
+    for (int i = 0; i < int(jobs.size()); i++) {
+        const NoiseParameter& p = jobs[i];
+        bool last_job = (i == int(jobs.size())-1);
+
+        // long lists: keep the GUI alive between jobs too
+        report();
+        QCoreApplication::processEvents();
+        if (break_execution && *break_execution) break;
+
+        // already created in an earlier run, the cache holds float templates only
+        bool cached_format = int16_scale(p.file) == 0;
+        if (cache && !p.key.isEmpty() && cached_format && cache->copy(p.key, p.file)) {
+            job_done(true, 0);
+            if (last_job) {
+                int s = acquire_slot(break_execution);
+                if (s < 0) break;
+                cache->lookup(p.key, slots[s]->v);
+                last_slot = s;
+                release_slot(s);
+            }
+            if (break_execution && *break_execution) break;
+            continue;
+        }
+
+        int s = acquire_slot(break_execution);
+        if (s < 0) break;
+
+        // spectrum is drawn here, the rest is done in parallel
+        if (!p.stream && p.process == 0) {
+            NoiseWorkspace& w = slots[s]->workspace;
+            w.setup(p.dur, p.sample);
+            create_noise_spectrum(p.dur, p.f0, p.f1, p.seed, w, &p.shape);
+        }
+
+        last_slot = s;
+        pool.start(new Job(this, p, s));
+    }
+
+    while (!pool.waitForDone(50)) {
+        report();
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 50);
+    }
+    report(true);
+
+    return nfailed == 0;
+}
@@ -0,0 +1,133 @@
+/*****************************************************************************************************************
+
+    Batch Template Creation: many templates generated in parallel and written to disk
+
+    Author: Christoph Kirst (ckirst@nld.ds.mpg.de)
+    Date:   2012, LMU Munich
+
+ *****************************************************************************************************************/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <QObject>
+#include <QString>
+#include <QTime>
+#include <QMutex>
+#include <QSemaphore>
+#include <QThreadPool>
+
+#include <vector>
+
+#include "numerics.h"
+#include "heka.h"
+#include "templatecache.h"
+
+
+/*! Container to store all parameter of a single noise template, see \ref create_noise and \ref postprocess_template
+*/
+struct NoiseParameter {
+    double dur, sample;     // duration [sec] and sampling rate [kHz]
+    double f, phase, amp;   // LFP like sine
+    double f0, f1, sigma;   // noise band [Hz] and standard deviation
+    NoiseShape shape;       // spectrum within the band
+    bool stream;            // overlap-add synthesis for long templates, see NoiseStream
+    int process;            // 0: band noise, 1: Ornstein-Uhlenbeck, 2: low pass filtered at f1
+    double tau;             // correlation time [ms] of the Ornstein-Uhlenbeck process
+    int seed;
+    double off, left, right;
+
+    QString file;           // template file to write to
+    QString key;            // TemplateCache key, empty for no caching
+};
+
+
+/*! Writes the noise template \param p by a \ref NoiseStream directly to its file in chunks, so memory does not
+ *  grow with the duration. The first \param npreview samples are kept in \param preview if given.
+ *  Each chunk is converted to int16 right after it is generated if \param int16_scale != 0,
+ *  see \ref Heka::template_int16_scale
+ */
+bool write_noise_stream(Heka* heka, const NoiseParameter& p, double int16_scale, DataVECTOR* preview = 0,
+                        int npreview = 0);
+
+/*! Writes the step protocol \param steps to the template file \param file, expanded in chunks, followed by
+ *  \ref TEMPLATE_PADDING samples of its last level.
+ */
+bool write_step_protocol(Heka* heka, const StepProtocol& steps, const QString& file);
+
+
+/*! Creates noise templates that differ only in their seed on a thread pool and writes them to their template files.
+ *  The random phases are drawn on the calling thread (rand() is not thread safe and the seeds have to
+ *  give the same templates as \ref create_noise), the fft, normalization and file writing run on the pool.
+ *  Streamed templates (\ref NoiseParameter::stream) are created entirely on the pool by \ref write_noise_stream,
+ *  filtered noise (\ref NoiseParameter::process) by \ref create_ou_noise or \ref create_filtered_noise.
+ *  All templates share the fft setup and a fixed number of scratch workspaces, so memory stays bounded.
+ *  Templates found in \ref cache are copied instead of created, new ones are added to it.
+ *  The int16 settings of \param heka are copied when the batch is created, later changes do not apply to it.
+ *  While running, \ref progress is emitted from the calling thread a few times per second.
+ */
+class NoiseBatch : public QObject {
+    Q_OBJECT
+
+public:
+    NoiseBatch(Heka* heka, TemplateCache* cache = 0);
+    ~NoiseBatch();
+
+    void add(const NoiseParameter& p);
+    int size() const { return int(jobs.size()); }
+
+    /*! creates and writes all templates, keeps the GUI alive while waiting and stops early if
+     *  \param break_execution is set. Returns false if a template could not be written
+     */
+    bool run(bool* break_execution = 0);
+
+    int failed() const { return nfailed; }
+    int done() const { return ndone; }
+
+    static const int preview_length = 1 << 20;
+
+    /*! the last template created, e.g. for plotting, for streamed templates its first \ref preview_length samples */
+    const DataVECTOR& last() const;
+
+signals:
+    /*! \param done of \param total templates are written, at \param rate templates and \param sample_rate
+     *  template samples per second since the start
+     */
+    void progress(int done, int total, double rate, double sample_rate);
+
+private:
+    // scratch space of one worker
+    struct Slot {
+        NoiseWorkspace workspace;
+        DataVECTOR v;
+    };
+
+    class Job;
+
+    Heka* heka;
+    TemplateCache* cache;
+    QStringList int16_sequences;
+    double int16_range;
+    std::vector<NoiseParameter> jobs;
+    std::vector<Slot*> slots;
+    int last_slot;
+
+    QThreadPool pool;
+    QSemaphore free_slots;
+    QMutex mutex;
+    std::vector<int> free_list;
+    int nfailed, ndone;
+    qint64 nsamples;
+
+    QTime timer;
+    int last_report;
+
+    int acquire_slot(bool* break_execution);
+    void release_slot(int s);
+    void job_done(bool ok, qint64 n);
+    void report(bool force = false);
+    double int16_scale(const QString& file) const;
+};
+
+
+#endif // BATCH_H
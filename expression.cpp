@@ -0,0 +1,432 @@
+/*****************************************************************************************************************
+
+    Stimulus Expressions: user defined stimuli compiled from formulas like amp*sin(2*pi*(f0*t + k*t^2)) + off
+
+    Author: Christoph Kirst (ckirst@nld.ds.mpg.de)
+    Date:   2012, LMU Munich
+
+ *****************************************************************************************************************/
+
+#include "expression.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cctype>
+#include <sstream>
+#include <algorithm>
+
+
+// samples evaluated per instruction, small enough for the stack of blocks to stay in cache
+static const int expression_block = 1024;
+
+// samples per parallel task
+static const int expression_task = 1 << 16;
+
+
+/*****************************************************************************************************************
+ *
+ *      Parser
+ *
+ *****************************************************************************************************************/
+
+Expression::Expression() : depth(0), pos(0) {}
+
+bool Expression::compile(const std::string& str, std::string& err) {
+    return compile(str, std::map<std::string, double>(), err);
+}
+
+bool Expression::compile(const std::string& str, const std::map<std::string, double>& c, std::string& err) {
+    text = str;
+    pos = 0;
+    constants = c;
+    error.clear();
+    program.clear();
+
+    bool suc = parse_comparison();
+    skip_space();
+    if (suc && pos < text.size()) suc = fail("unexpected '" + text.substr(pos, 1) + "'");
+
+    if (!suc) {
+        program.clear();
+        err = error;
+        return false;
+    }
+
+    // stack depth
+    int d = 0;
+    depth = 0;
+    for (int i = 0; i < int(program.size()); i++) {
+        Code c = program[i].code;
+        if (c == Const || c == Time || c == Index) d++;
+        else if (!unary(c) && !program[i].constant) d--;
+        depth = std::max(depth, d);
+    }
+
+    return true;
+}
+
+void Expression::skip_space() {
+    while (pos < text.size() && isspace(text[pos])) pos++;
+}
+
+bool Expression::fail(const std::string& what) {
+    if (error.empty()) {
+        std::ostringstream str;
+        str << what << " at position " << pos + 1;
+        error = str.str();
+    }
+    return false;
+}
+
+// appends an instruction, folds constants and fuses constant right operands
+void Expression::emit(Code c) {
+    int n = program.size();
+
+    if (unary(c)) {
+        if (n >= 1 && program[n-1].code == Const) {
+            program[n-1].k = apply(c, program[n-1].k);
+            return;
+        }
+    } else if (c != Const && c != Time && c != Index) {
+        if (n >= 2 && program[n-1].code == Const && program[n-2].code == Const) {
+            program[n-2].k = apply(c, program[n-2].k, program[n-1].k);
+            program.pop_back();
+            return;
+        }
+        if (n >= 1 && program[n-1].code == Const) {
+            double k = program[n-1].k;
+            program.pop_back();
+            program.push_back(Op(c, k, true));
+            return;
+        }
+    }
+
+    program.push_back(Op(c));
+}
+
+bool Expression::parse_comparison() {
+    if (!parse_sum()) return false;
+
+    skip_space();
+    if (pos < text.size() && (text[pos] == '<' || text[pos] == '>')) {
+        bool less = text[pos] == '<';
+        bool equal = pos + 1 < text.size() && text[pos+1] == '=';
+        pos += equal ? 2 : 1;
+        if (!parse_sum()) return false;
+        emit(less ? (equal ? LessEqual : Less) : (equal ? GreaterEqual : Greater));
+    }
+    return true;
+}
+
+bool Expression::parse_sum() {
+    if (!parse_product()) return false;
+
+    for (;;) {
+        skip_space();
+        if (pos >= text.size() || (text[pos] != '+' && text[pos] != '-')) return true;
+        Code c = text[pos] == '+' ? Add : Sub;
+        pos++;
+        if (!parse_product()) return false;
+        emit(c);
+    }
+}
+
+bool Expression::parse_product() {
+    if (!parse_unary()) return false;
+
+    for (;;) {
+        skip_space();
+        if (pos >= text.size() || (text[pos] != '*' && text[pos] != '/')) return true;
+        Code c = text[pos] == '*' ? Mul : Div;
+        pos++;
+        if (!parse_unary()) return false;
+        emit(c);
+    }
+}
+
+// -x^2 = -(x^2)
+bool Expression::parse_unary() {
+    skip_space();
+    if (pos < text.size() && (text[pos] == '-' || text[pos] == '+')) {
+        bool neg = text[pos] == '-';
+        pos++;
+        if (!parse_unary()) return false;
+        if (neg) emit(Neg);
+        return true;
+    }
+    return parse_power();
+}
+
+// right associative: 2^3^2 = 2^(3^2)
+bool Expression::parse_power() {
+    if (!parse_primary()) return false;
+
+    skip_space();
+    if (pos < text.size() && text[pos] == '^') {
+        pos++;
+        if (!parse_unary()) return false;
+        emit(Pow);
+    }
+    return true;
+}
+
+bool Expression::parse_primary() {
+    skip_space();
+    if (pos >= text.size()) return fail("unexpected end");
+
+    char ch = text[pos];
+
+    if (ch == '(') {
+        pos++;
+        if (!parse_comparison()) return false;
+        skip_space();
+        if (pos >= text.size() || text[pos] != ')') return fail("missing ')'");
+        pos++;
+        return true;
+    }
+
+    if (isdigit(ch) || ch == '.') {
+        const char* start = text.c_str() + pos;
+        char* end;
+        double k = strtod(start, &end);
+        if (end == start) return fail("invalid number");
+        pos += end - start;
+        program.push_back(Op(Const, k));
+        return true;
+    }
+
+    if (!isalpha(ch) && ch != '_') return fail("unexpected '" + text.substr(pos, 1) + "'");
+
+    size_t start = pos;
+    while (pos < text.size() && (isalnum(text[pos]) || text[pos] == '_')) pos++;
+    std::string name = text.substr(start, pos - start);
+
+    skip_space();
+    if (pos < text.size() && text[pos] == '(') {
+        static const char* unary_names[] = {"sin", "cos", "tan", "asin", "acos", "atan", "sinh", "cosh", "tanh",
+                                            "exp", "log", "log10", "sqrt", "abs", "floor", "ceil", "sign"};
+        static const char* binary_names[] = {"pow", "min", "max", "atan2", "mod"};
+        static const Code binary_codes[] = {Pow, Min, Max, Atan2, Mod};
+
+        int nargs = 0;
+        Code c = Const;
+        for (int i = 0; i < int(sizeof(unary_names) / sizeof(unary_names[0])); i++) {
+            if (name == unary_names[i]) { c = Code(Sin + i); nargs = 1; }
+        }
+        for (int i = 0; i < int(sizeof(binary_names) / sizeof(binary_names[0])); i++) {
+            if (name == binary_names[i]) { c = binary_codes[i]; nargs = 2; }
+        }
+        if (nargs == 0) {
+            pos = start;
+            return fail("unknown function '" + name + "'");
+        }
+
+        pos++;
+        for (int a = 0; a < nargs; a++) {
+            if (a > 0) {
+                skip_space();
+                if (pos >= text.size() || text[pos] != ',') return fail("missing ',' in " + name);
+                pos++;
+            }
+            if (!parse_comparison()) return false;
+        }
+        skip_space();
+        if (pos >= text.size() || text[pos] != ')') return fail("missing ')' in " + name);
+        pos++;
+
+        emit(c);
+        return true;
+    }
+
+    if (name == "t") {
+        program.push_back(Op(Time));
+    } else if (name == "n") {
+        program.push_back(Op(Index));
+    } else if (constants.count(name)) {
+        program.push_back(Op(Const, constants[name]));
+    } else if (name == "pi") {
+        program.push_back(Op(Const, 3.14159265358979323846));
+    } else if (name == "e") {
+        program.push_back(Op(Const, 2.71828182845904523536));
+    } else {
+        pos = start;
+        return fail("unknown name '" + name + "'");
+    }
+    return true;
+}
+
+
+bool Expression::parse_constants(const std::string& str, std::map<std::string, double>& c, std::string& err) {
+    std::string s = str;
+    std::replace(s.begin(), s.end(), ',', ';');
+
+    std::istringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ';')) {
+        size_t eq = item.find('=');
+        if (item.find_first_not_of(" \t") == std::string::npos) continue;
+        if (eq == std::string::npos) {
+            err = "missing '=' in '" + item + "'";
+            return false;
+        }
+
+        std::istringstream name_str(item.substr(0, eq));
+        std::istringstream value_str(item.substr(eq + 1));
+        std::string name, rest;
+        double value;
+        if (!(name_str >> name) || (name_str >> rest) || !(value_str >> value) || (value_str >> rest)) {
+            err = "cannot parse '" + item + "'";
+            return false;
+        }
+        c[name] = value;
+    }
+    return true;
+}
+
+
+/*****************************************************************************************************************
+ *
+ *      Evaluation
+ *
+ *****************************************************************************************************************/
+
+double Expression::apply(Code c, double x) {
+    switch (c) {
+        case Neg:   return -x;
+        case Sin:   return sin(x);
+        case Cos:   return cos(x);
+        case Tan:   return tan(x);
+        case Asin:  return asin(x);
+        case Acos:  return acos(x);
+        case Atan:  return atan(x);
+        case Sinh:  return sinh(x);
+        case Cosh:  return cosh(x);
+        case Tanh:  return tanh(x);
+        case Exp:   return exp(x);
+        case Log:   return log(x);
+        case Log10: return log10(x);
+        case Sqrt:  return sqrt(x);
+        case Abs:   return fabs(x);
+        case Floor: return floor(x);
+        case Ceil:  return ceil(x);
+        case Sign:  return x > 0 ? 1 : (x < 0 ? -1 : 0);
+        default:    return x;
+    }
+}
+
+double Expression::apply(Code c, double x, double y) {
+    switch (c) {
+        case Add:          return x + y;
+        case Sub:          return x - y;
+        case Mul:          return x * y;
+        case Div:          return x / y;
+        case Pow:          return y == 2 ? x * x : pow(x, y);
+        case Min:          return std::min(x, y);
+        case Max:          return std::max(x, y);
+        case Atan2:        return atan2(x, y);
+        case Mod:          return fmod(x, y);
+        case Less:         return x < y;
+        case Greater:      return x > y;
+        case LessEqual:    return x <= y;
+        case GreaterEqual: return x >= y;
+        default:           return x;
+    }
+}
+
+
+void Expression::evaluate(int from, int n, double dt, DataTYPE off, DataTYPE* v) const {
+    if (program.empty()) return;
+
+    int nb = std::min(n, expression_block);
+    std::vector<double> stack(std::max(depth, 1) * nb);
+
+    for (int i0 = 0; i0 < n; i0 += nb) {
+        int m = std::min(nb, n - i0);
+        int sp = 0;  // number of blocks on the stack
+
+        for (int k = 0; k < int(program.size()); k++) {
+            const Op& op = program[k];
+
+            if (op.code == Const || op.code == Time || op.code == Index) {
+                double* a = &stack[sp * nb];
+                int s = from + i0;
+                if (op.code == Const) std::fill(a, a + m, op.k);
+                else if (op.code == Time) for (int i = 0; i < m; i++) a[i] = (s + i) * dt;
+                else for (int i = 0; i < m; i++) a[i] = s + i;
+                sp++;
+                continue;
+            }
+
+            if (unary(op.code)) {
+                double* a = &stack[(sp-1) * nb];
+                if (op.code == Neg) for (int i = 0; i < m; i++) a[i] = -a[i];
+                else for (int i = 0; i < m; i++) a[i] = apply(op.code, a[i]);
+                continue;
+            }
+
+            // binary: result replaces the left operand
+            double* a;
+            if (op.constant) {
+                a = &stack[(sp-1) * nb];
+                double y = op.k;
+                switch (op.code) {
+                    case Add: for (int i = 0; i < m; i++) a[i] += y; break;
+                    case Sub: for (int i = 0; i < m; i++) a[i] -= y; break;
+                    case Mul: for (int i = 0; i < m; i++) a[i] *= y; break;
+                    case Div: for (int i = 0; i < m; i++) a[i] /= y; break;
+                    default:  for (int i = 0; i < m; i++) a[i] = apply(op.code, a[i], y);
+                }
+            } else {
+                a = &stack[(sp-2) * nb];
+                const double* b = &stack[(sp-1) * nb];
+                switch (op.code) {
+                    case Add: for (int i = 0; i < m; i++) a[i] += b[i]; break;
+                    case Sub: for (int i = 0; i < m; i++) a[i] -= b[i]; break;
+                    case Mul: for (int i = 0; i < m; i++) a[i] *= b[i]; break;
+                    case Div: for (int i = 0; i < m; i++) a[i] /= b[i]; break;
+                    default:  for (int i = 0; i < m; i++) a[i] = apply(op.code, a[i], b[i]);
+                }
+                sp--;
+            }
+        }
+
+        const double* r = &stack[0];
+        DataTYPE* vb = v + i0;
+        for (int i = 0; i < m; i++) vb[i] = r[i] + off;
+    }
+}
+
+
+// parallel evaluation in tasks of expression_task samples
+class ExpressionTask : public BlockTask {
+public:
+    ExpressionTask(const Expression& e, int n, double dt, DataTYPE off, DataTYPE* v)
+        : e(e), n(n), dt(dt), off(off), v(v) {}
+
+    void block(int b) {
+        int from = b * expression_task;
+        e.evaluate(from, std::min(expression_task, n - from), dt, off, v + from);
+    }
+
+    const Expression& e;
+    int n;
+    double dt;
+    DataTYPE off;
+    DataTYPE* v;
+};
+
+void Expression::create(DataTYPE dur, DataTYPE samp, DataTYPE off, DataTYPE* v, bool parallel) const {
+    int n = template_length(dur, samp);
+    double dt = 1.0 / samp / 1000.0;
+
+    ExpressionTask task(*this, n, dt, off, v);
+    int nblocks = (n + expression_task - 1) / expression_task;
+    run_blocks(task, nblocks, parallel && nblocks > 1);
+}
+
+bool Expression::create(DataTYPE dur, DataTYPE samp, DataVECTOR& v) const {
+    if (!valid()) return false;
+    v.resize(template_length(dur, samp));
+    if (!v.empty()) create(dur, samp, 0, &v[0]);
+    return true;
+}
@@ -0,0 +1,94 @@
+/*****************************************************************************************************************
+
+    Stimulus Expressions: user defined stimuli compiled from formulas like amp*sin(2*pi*(f0*t + k*t^2)) + off
+
+    Author: Christoph Kirst (ckirst@nld.ds.mpg.de)
+    Date:   2012, LMU Munich
+
+ *****************************************************************************************************************/
+
+#ifndef EXPRESSION_H
+#define EXPRESSION_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "numerics.h"
+
+
+/*! Stimulus given by a formula in the time t [sec] and sample index n, e.g. "amp*sin(2*pi*(f0*t + k*t^2))".
+ *  Supported are numbers, + - * / ^ (power), comparisons < > <= >= giving 0 or 1, the constants pi and e,
+ *  named constants set by \ref compile and the functions sin, cos, tan, asin, acos, atan, sinh, cosh, tanh,
+ *  exp, log, log10, sqrt, abs, floor, ceil, sign, atan2(y,x), pow(x,y), min(x,y), max(x,y) and mod(x,y).
+ *  The formula is parsed once into a stack program, constant sub-expressions are folded. The program is
+ *  evaluated instruction by instruction on whole blocks of samples, so the interpretation costs once per
+ *  block and the inner loops are plain array loops; blocks are run on several threads.
+ */
+class Expression {
+public:
+    Expression();
+
+    /*! parses \param text with the named constants \param constants, on failure returns false and a description
+     *  in \param error
+     */
+    bool compile(const std::string& text, const std::map<std::string, double>& constants, std::string& error);
+    bool compile(const std::string& text, std::string& error);
+
+    bool valid() const { return !program.empty(); }
+
+    /*! evaluates samples \param from to \param from + \param n, sample i at t = i * \param dt, with offset
+     *  \param off added, into \param v
+     */
+    void evaluate(int from, int n, double dt, DataTYPE off, DataTYPE* v) const;
+
+    /*! stimulus of duration \param dur [sec] at sampling frequency \param samp [kHz], \ref template_length samples
+     */
+    void create(DataTYPE dur, DataTYPE samp, DataTYPE off, DataTYPE* v, bool parallel = true) const;
+    bool create(DataTYPE dur, DataTYPE samp, DataVECTOR& v) const;
+
+    /*! parses constants "name = value" separated by ; or , from \param text into \param constants
+     */
+    static bool parse_constants(const std::string& text, std::map<std::string, double>& constants, std::string& error);
+
+private:
+    enum Code {Const, Time, Index,
+               Neg, Sin, Cos, Tan, Asin, Acos, Atan, Sinh, Cosh, Tanh, Exp, Log, Log10, Sqrt, Abs, Floor, Ceil, Sign,
+               Add, Sub, Mul, Div, Pow, Min, Max, Atan2, Mod, Less, Greater, LessEqual, GreaterEqual};
+
+    // instruction: binary operations with a constant right operand take it from k instead of the stack
+    struct Op {
+        Code code;
+        double k;
+        bool constant;
+
+        Op(Code c, double k = 0, bool constant = false) : code(c), k(k), constant(constant) {}
+    };
+
+    std::vector<Op> program;
+    int depth;
+
+    // parser state
+    std::string text;
+    size_t pos;
+    std::map<std::string, double> constants;
+    std::string error;
+
+    bool parse_comparison();
+    bool parse_sum();
+    bool parse_product();
+    bool parse_unary();
+    bool parse_power();
+    bool parse_primary();
+
+    void skip_space();
+    bool fail(const std::string& what);
+    void emit(Code c);
+
+    static bool unary(Code c) { return c >= Neg && c <= Sign; }
+    static double apply(Code c, double x);
+    static double apply(Code c, double x, double y);
+};
+
+
+#endif // EXPRESSION_H
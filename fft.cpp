@@ -35,7 +35,7 @@
       y[k] = sum(x[m]*exp(-i*2*pi*k*m/n), m=0..(n-1)), k=0,...,(n-1)
 
       The largest prime factor of n must be less than or equal to the
-      constant maxPrimeFactor defined below.
+      constant FFTPlan::maxPrimeFactor defined in fft.h.
  ------------------------------------------------------------------------
   Implementation notes:
       The general idea is to factor the length of the DFT, n, into
@@ -87,37 +87,28 @@
       fft_odd         :  length n DFT, n odd.
 *************************************************************************/
 
-#define  maxPrimeFactor        37
-#define  maxPrimeFactorDiv2    (maxPrimeFactor+1)/2
-#define  maxFactorCount        20
-
-static double  c3_1 = -1.5000000000000E+00;  /*  c3_1 = cos(2*pi/3)-1;          */
-static double  c3_2 =  8.6602540378444E-01;  /*  c3_2 = sin(2*pi/3);            */
-
-static double  u5   =  1.2566370614359E+00;  /*  u5   = 2*pi/5;                 */
-static double  c5_1 = -1.2500000000000E+00;  /*  c5_1 = (cos(u5)+cos(2*u5))/2-1;*/
-static double  c5_2 =  5.5901699437495E-01;  /*  c5_2 = (cos(u5)-cos(2*u5))/2;  */
-static double  c5_3 = -9.5105651629515E-01;  /*  c5_3 = -sin(u5);               */
-static double  c5_4 = -1.5388417685876E+00;  /*  c5_4 = -(sin(u5)+sin(2*u5));   */
-static double  c5_5 =  3.6327126400268E-01;  /*  c5_5 = (sin(u5)-sin(2*u5));    */
-static double  c8   =  7.0710678118655E-01;  /*  c8 = 1/sqrt(2);    */
-
-static double   pi;
-static int      groupOffset,dataOffset,blockOffset,adr;
-static int      groupNo,dataNo,blockNo,twNo;
-static double   omega, tw_re,tw_im;
-static double   twiddleRe[maxPrimeFactor], twiddleIm[maxPrimeFactor],
-                trigRe[maxPrimeFactor], trigIm[maxPrimeFactor],
-                zRe[maxPrimeFactor], zIm[maxPrimeFactor];
-static double   vRe[maxPrimeFactorDiv2], vIm[maxPrimeFactorDiv2];
-static double   wRe[maxPrimeFactorDiv2], wIm[maxPrimeFactorDiv2];
-
-void factorize(int n, int *nFact, int fact[])
+static const double  c3_1 = -1.5000000000000E+00;  /*  c3_1 = cos(2*pi/3)-1;          */
+static const double  c3_2 =  8.6602540378444E-01;  /*  c3_2 = sin(2*pi/3);            */
+
+static const double  u5   =  1.2566370614359E+00;  /*  u5   = 2*pi/5;                 */
+static const double  c5_1 = -1.2500000000000E+00;  /*  c5_1 = (cos(u5)+cos(2*u5))/2-1;*/
+static const double  c5_2 =  5.5901699437495E-01;  /*  c5_2 = (cos(u5)-cos(2*u5))/2;  */
+static const double  c5_3 = -9.5105651629515E-01;  /*  c5_3 = -sin(u5);               */
+static const double  c5_4 = -1.5388417685876E+00;  /*  c5_4 = -(sin(u5)+sin(2*u5));   */
+static const double  c5_5 =  3.6327126400268E-01;  /*  c5_5 = (sin(u5)-sin(2*u5));    */
+static const double  c8   =  7.0710678118655E-01;  /*  c8 = 1/sqrt(2);    */
+
+static const double  pi = 4*atan(1);
+
+/* the former global work variables (twiddle and trig tables, z, v, w, offsets)
+   are members of FFTPlan now, so that several transforms can run in parallel */
+
+static void factorize(int n, int *nFact, int fact[])
 {
     int i,j,k;
     int nRadix;
     int radices[7];
-    int factors[maxFactorCount];
+    int factors[FFTPlan::maxFactorCount];
 
     nRadix    =  6;
     radices[1]=  2;
@@ -184,14 +175,14 @@ void factorize(int n, int *nFact, int fact[])
     remain  : the product of the remaining radices.
  ****************************************************************************/
 
-void transTableSetup(int sofar[], int actual[], int remain[],
+static void transTableSetup(int sofar[], int actual[], int remain[],
                      int *nFact,
                      int *nPoints)
 {
     int i;
 
     factorize(*nPoints, nFact, actual);
-    if (actual[*nFact] > maxPrimeFactor)
+    if (actual[*nFact] > FFTPlan::maxPrimeFactor)
     {
         printf("\nPrime factor of FFT length too large : %6d",actual[*nFact]);
         exit(1);
@@ -212,14 +203,14 @@ void transTableSetup(int sofar[], int actual[], int remain[],
   normal order.
  ****************************************************************************/
 
-void permute(int nPoint, int nFact,
+static void permute(int nPoint, int nFact,
              int fact[], int remain[],
              double xRe[], double xIm[],
              double yRe[], double yIm[])
 
 {
     int i,j,k;
-    int count[maxFactorCount];
+    int count[FFTPlan::maxFactorCount];
 
     for (i=1; i<=nFact; i++) count[i]=0;
     k=0;
@@ -250,7 +241,7 @@ void permute(int nPoint, int nFact,
   following stages.
  ***************************************************************************/
 
-void initTrig(int radix)
+void FFTPlan::initTrig(int radix)
 {
     int i;
     double w,xre,xim;
@@ -268,7 +259,7 @@ void initTrig(int radix)
     }
 }   /* initTrig */
 
-void fft_4(double aRe[], double aIm[])
+static void fft_4(double aRe[], double aIm[])
 {
     double  t1_re,t1_im, t2_re,t2_im;
     double  m2_re,m2_im, m3_re,m3_im;
@@ -286,7 +277,7 @@ void fft_4(double aRe[], double aIm[])
 }   /* fft_4 */
 
 
-void fft_5(double aRe[], double aIm[])
+static void fft_5(double aRe[], double aIm[])
 {
     double  t1_re,t1_im, t2_re,t2_im, t3_re,t3_im;
     double  t4_re,t4_im, t5_re,t5_im;
@@ -320,7 +311,7 @@ void fft_5(double aRe[], double aIm[])
     aRe[4]=s2_re - s3_re; aIm[4]=s2_im - s3_im;
 }   /* fft_5 */
 
-void fft_8()
+void FFTPlan::fft_8()
 {
     double  aRe[4], aIm[4], bRe[4], bIm[4], gem;
 
@@ -357,7 +348,7 @@ void fft_8()
     zIm[3] = aIm[3] + bIm[3]; zIm[7] = aIm[3] - bIm[3];
 }   /* fft_8 */
 
-void fft_10()
+void FFTPlan::fft_10()
 {
     double  aRe[5], aIm[5], bRe[5], bIm[5];
 
@@ -388,7 +379,7 @@ void fft_10()
     zIm[4] = aIm[4] + bIm[4]; zIm[9] = aIm[4] - bIm[4];
 }   /* fft_10 */
 
-void fft_odd(int radix)
+void FFTPlan::fft_odd(int radix)
 {
     double  rere, reim, imre, imim;
     int     i,j,k,n,max;
@@ -434,7 +425,7 @@ void fft_odd(int radix)
 }   /* fft_odd */
 
 
-void twiddleTransf(int sofarRadix, int radix, int remainRadix,
+void FFTPlan::twiddleTransf(int sofarRadix, int radix, int remainRadix,
                     double yRe[], double yIm[])
 
 {   /* twiddleTransf */
@@ -572,24 +563,38 @@ void twiddleTransf(int sofarRadix, int radix, int remainRadix,
 }   /* twiddleTransf */
 
 
-void fft(int n, double xRe[], double xIm[],
-                double yRe[], double yIm[])
-{
-    int   sofarRadix[maxFactorCount],
-          actualRadix[maxFactorCount],
-          remainRadix[maxFactorCount];
-    int   nFactor;
-    int   count;
+FFTPlan::FFTPlan() : n(0), nFactor(0) {}
 
-    pi = 4*atan(1);
+FFTPlan::FFTPlan(int size) : n(0), nFactor(0) {
+    setup(size);
+}
 
+void FFTPlan::setup(int size)
+{
+    if (size == n) return;
+    n = size;
     transTableSetup(sofarRadix, actualRadix, remainRadix, &nFactor, &n);
+}   /* setup */
+
+void FFTPlan::execute(double xRe[], double xIm[],
+                      double yRe[], double yIm[])
+{
+    int   count;
+
     permute(n, nFactor, actualRadix, remainRadix, xRe, xIm, yRe, yIm);
 
     for (count=1; count<=nFactor; count++)
       twiddleTransf(sofarRadix[count], actualRadix[count], remainRadix[count],
                     yRe, yIm);
 
+}   /* execute */
+
+
+void fft(int n, double xRe[], double xIm[],
+                double yRe[], double yIm[])
+{
+    FFTPlan plan(n);
+    plan.execute(xRe, xIm, yRe, yIm);
 }   /* fft */
 
 
@@ -10,6 +10,46 @@
 #ifndef FFT_H
 #define FFT_H
 
+/*! Setup of \ref fft for a fixed transformation length \param n: the factorization of n is computed once
+ *  and the plan carries its own scratch space. Repeated transforms of the same length can reuse a plan,
+ *  and transforms in different threads are safe as long as each thread uses its own plan.
+ */
+class FFTPlan {
+public:
+    enum { maxPrimeFactor = 37, maxPrimeFactorDiv2 = (maxPrimeFactor+1)/2, maxFactorCount = 20 };
+
+    FFTPlan();
+    explicit FFTPlan(int n);
+
+    void setup(int n);
+    int size() const { return n; }
+
+    /*! Fourier transforms \param xRe, \param xIm into \param yRe, \param yIm, see \ref fft
+     */
+    void execute(double xRe[], double xIm[], double yRe[], double yIm[]);
+
+private:
+    int n;
+    int nFactor;
+    int sofarRadix[maxFactorCount], actualRadix[maxFactorCount], remainRadix[maxFactorCount];
+
+    int     groupOffset,dataOffset,blockOffset,adr;
+    int     groupNo,dataNo,blockNo,twNo;
+    double  omega, tw_re,tw_im;
+    double  twiddleRe[maxPrimeFactor], twiddleIm[maxPrimeFactor],
+            trigRe[maxPrimeFactor], trigIm[maxPrimeFactor],
+            zRe[maxPrimeFactor], zIm[maxPrimeFactor];
+    double  vRe[maxPrimeFactorDiv2], vIm[maxPrimeFactorDiv2];
+    double  wRe[maxPrimeFactorDiv2], wIm[maxPrimeFactorDiv2];
+
+    void initTrig(int radix);
+    void fft_8();
+    void fft_10();
+    void fft_odd(int radix);
+    void twiddleTransf(int sofarRadix, int radix, int remainRadix, double yRe[], double yIm[]);
+};
+
+
 /*! Fast Fourier Transfrom optimized for radix-10. Fourier transforms the complex vector
  * \param xRe and \param xIm of length \param n into the complex vector \param yRe and \param yIm
  * the algorithm is optimized for radix-10
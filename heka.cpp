@@ -10,12 +10,16 @@
 #include "heka.h"
 
 #include "debug.h"
+#include "numerics.h"
 
 #include <QCoreApplication>
 #include <QString>
+#include <QRegExp>
 #include <QFileInfo>
 #include <QDir>
 
+#include <algorithm>
+
 
 /*****************************************************************************************************************
  *
@@ -135,14 +139,33 @@ bool Heka::read_template_file(const QString& fname, TemplateVECTOR& d) {
    file.seekg(0, std::ios_base::end);
    std::streampos end = file.tellg();
    file.seekg(pos, std::ios_base::beg);
-   int data_size = (end-pos)/sizeof(TemplateTYPE);
 
-   //data.resize(size);
+   double int16_scale = template_int16_scale(fname);
+   if (int16_scale == 0) {
+      int data_size = (end-pos)/sizeof(TemplateTYPE);
+
+      //data.resize(size);
+      d.resize(data_size);
+      if (data_size > 0) file.read((char *) & d[0] , data_size*sizeof(TemplateTYPE));
+      file.close();
+
+      return true;
+   }
+
+   // int16 template: read and scaled back in chunks
+   int data_size = (end-pos)/sizeof(IntTemplateTYPE);
    d.resize(data_size);
-   file.read((char *) & d[0] , data_size*sizeof(TemplateTYPE));
+   const int chunk = 1 << 14;
+   std::vector<IntTemplateTYPE> buf(std::min(data_size, chunk));
+   for (int i = 0; i < data_size && file.good(); i += chunk) {
+      int k = std::min(chunk, data_size - i);
+      file.read((char *) &buf[0], k * sizeof(IntTemplateTYPE));
+      for (int j = 0; j < k; j++) d[i + j] = TemplateTYPE(buf[j] / int16_scale);
+   }
+   bool suc = file.good();
    file.close();
 
-   return true;
+   return suc;
 }
 
 
@@ -150,16 +173,61 @@ bool Heka::write_template_file(const QString& fname, const TemplateVECTOR& d) {
 
    /* open file as binary */
    std::fstream file;
-   file.open( fname.toStdString().c_str(), std::ios::out | std::ios::binary );
-   if (!file.good()) return false;
+   if (!open_template_file(fname, file)) return false;
 
    /* write data */
    DEBUG("writinig data")
-   file.write( (char *) &d[0], d.size() * sizeof(TemplateTYPE) );
+   bool suc = write_template_data(file, d.empty() ? 0 : &d[0], d.size(), template_int16_scale(fname));
 
+   close_template_file(file);
+
+   return suc;
+}
+
+
+bool Heka::open_template_file(const QString& fname, std::fstream& file) {
+   file.open( fname.toStdString().c_str(), std::ios::out | std::ios::binary );
+   return file.good();
+}
+
+bool Heka::write_template_data(std::fstream& file, const TemplateTYPE* d, int n, double int16_scale) {
+   if (int16_scale == 0) {
+      if (n > 0) file.write( (const char *) d, n * sizeof(TemplateTYPE) );
+      return file.good();
+   }
+
+   // converted in chunks small enough to stay in cache
+   const int chunk = 1 << 14;
+   std::vector<IntTemplateTYPE> buf(std::min(n, chunk));
+   for (int i = 0; i < n && file.good(); i += chunk) {
+      int k = std::min(chunk, n - i);
+      int nsat = convert_to_int16(d + i, k, int16_scale, &buf[0]);
+      if (nsat > 0) int16_saturated.fetchAndAddRelaxed(nsat);
+      file.write( (const char *) &buf[0], k * sizeof(IntTemplateTYPE) );
+   }
+   return file.good();
+}
+
+void Heka::close_template_file(std::fstream& file) {
    file.close();
+}
+
+double Heka::template_int16_scale(const QString& fname) const {
+   return template_int16_scale(fname, int16_sequences, int16_range);
+}
+
+double Heka::template_int16_scale(const QString& fname, const QStringList& sequences, double range) {
+   if (sequences.isEmpty() || range <= 0) return 0;
+
+   QString seq = QFileInfo(fname).completeBaseName();
+   QRegExp numbers("(_\\d+)+$");
+   seq.remove(numbers);
 
-   return true;
+   for (int i = 0; i < sequences.size(); i++) {
+      QRegExp rx(sequences[i], Qt::CaseSensitive, QRegExp::Wildcard);
+      if (rx.exactMatch(seq)) return 32767.0 / range;
+   }
+   return 0;
 }
 
 
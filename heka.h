@@ -12,6 +12,8 @@
 
 
 #include <QString>
+#include <QStringList>
+#include <QAtomicInt>
 #include <QMainWindow>
 #include <vector>
 #include <fstream>
@@ -44,10 +46,18 @@ public:
 
 public:
 
+    Heka() : int16_range(10.0) {}
+
+    //fixed point templates
+    QStringList int16_sequences;  // sequences written as int16, wildcards allowed
+    double int16_range;           // template value written as 32767
+    QAtomicInt int16_saturated;   // samples clipped to the int16 range, reset by the caller
+
     // Data Types
 
     typedef float TemplateTYPE;
     typedef std::vector<TemplateTYPE> TemplateVECTOR;
+    typedef short IntTemplateTYPE;
 
     /*! Container to store parameter of a HEKA segment
     */
@@ -114,16 +124,38 @@ public:
     QString sequence_to_template_file_name(const QString& sequence, const QString& pgfpath, int sweep, int channel);
 
 
-    /*! read a binary HEKA template file \param fname to vector \param d
+    /*! read a binary HEKA template file \param fname to vector \param d, int16 templates (see
+     *  \ref template_int16_scale) are scaled back to template values. The files have no header, so an int16
+     *  template is only recognized while its sequence is in \ref int16_sequences
     */
     bool read_template_file(const QString& fname, TemplateVECTOR& d);
 
 
-    /*! write a binary HEKA template file \param fname to vector \param d
+    /*! write a binary HEKA template file \param fname to vector \param d, as int16 if its sequence is
+     *  one of \ref int16_sequences
     */
     bool write_template_file(const QString& fname, const TemplateVECTOR& d);
 
 
+    /*! write a binary HEKA template file piece by piece: open \param fname, append \param n samples \param d
+     *  as often as needed and close it again. Used for templates too long to be kept in memory.
+     *  With \param int16_scale != 0 the samples are written as int16, see \ref template_int16_scale
+    */
+    bool open_template_file(const QString& fname, std::fstream& file);
+    bool write_template_data(std::fstream& file, const TemplateTYPE* d, int n, double int16_scale = 0);
+    void close_template_file(std::fstream& file);
+
+    /*! scale from template values to int16 for the template file \param fname, 0 if it is written as float.
+     *  The sequence of a file is its name without extension and trailing _channel / _sweep numbers
+    */
+    double template_int16_scale(const QString& fname) const;
+
+    /*! \ref template_int16_scale for the int16 sequences \param sequences and full scale \param range,
+     *  e.g. for a copy of the settings used by another thread
+    */
+    static double template_int16_scale(const QString& fname, const QStringList& sequences, double range);
+
+
     //Heka Batch Communication
 
     bool open_batch_command_file();
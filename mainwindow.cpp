@@ -16,6 +16,8 @@
 #include <QSettings>
 #include <QMessageBox>
 #include <QTime>
+#include <QFileInfo>
+#include <QThread>
 
 #include "qcustomplot.h"
 
@@ -29,6 +31,8 @@
 #include "heka.h"
 #include "numerics.h"
 #include "fft.h"
+#include "batch.h"
+#include "templatecache.h"
 
 
 
@@ -264,6 +268,21 @@ QString ParameterSet::toString() {
         return str;
     }
 
+// all values that determine a template (no file name) at full precision, used as cache key
+QString ParameterSet::toKeyString() {
+        QString str(name);
+        for (int i = 0; i < int(parameter.size()); i++) {
+            if (parameter[i].name == "file") continue;
+            QString v;
+            if (parameter[i].type == Parameter::Double)
+                v = QString::number(parameter[i].value.toDouble(), 'g', 17);
+            else
+                v = parameter[i].value.toString();
+            str = QString("%1,%2=%3").arg(str).arg(parameter[i].name).arg(v);
+        }
+        return str;
+    }
+
 void ParameterSet::write_settings(QSettings& settings) {
         settings.beginGroup(name);
         for ( std::vector<Parameter>::iterator it = parameter.begin(); it < parameter.end(); it++){
@@ -326,6 +345,8 @@ void MainWindow::setupParameter() {
     rdbuttons->push_back(ui->zap_exp_radioButton);
     p.parameter.push_back(Parameter("type", 0, 0, Parameter::Set, (QWidget*) rdbuttons));
     p.parameter.push_back(Parameter("file", "C:\\zap.tpl", "C:\\zap.tpl", Parameter::String,  ui->filename_Edit));
+    p.parameter.push_back(Parameter("precise", false, false, Parameter::Bool, (QWidget*) ui->preciseCheckBox));
+    p.parameter.push_back(Parameter("multirate", false, false, Parameter::Bool, (QWidget*) ui->multirateCheckBox));
 
     parameter.push_back(p);
     p.parameter.clear();
@@ -346,6 +367,15 @@ void MainWindow::setupParameter() {
     p.parameter.push_back(Parameter("left", 0.0, 0.0, Parameter::Double, ui->left_SpinBox));
     p.parameter.push_back(Parameter("right", 0.0, 0.0, Parameter::Double, ui->right_SpinBox));
     p.parameter.push_back(Parameter("file", "C:\\lfp.tpl", "C:\\lpf.tpl", Parameter::String, ui->filename_Edit));
+    p.parameter.push_back(Parameter("alpha", 0.0, 0.0, Parameter::Double, ui->alpha_SpinBox_2));
+    p.parameter.push_back(Parameter("psd", "", "", Parameter::String, ui->psd_lineEdit_2));
+    p.parameter.push_back(Parameter("stream", false, false, Parameter::Bool, (QWidget*) ui->stream_checkBox_2));
+    rdbuttons = new QVector<QRadioButton*>();
+    rdbuttons->push_back(ui->noise_band_radioButton);
+    rdbuttons->push_back(ui->noise_ou_radioButton);
+    rdbuttons->push_back(ui->noise_lowpass_radioButton);
+    p.parameter.push_back(Parameter("process", 0, 0, Parameter::Set, (QWidget*) rdbuttons));
+    p.parameter.push_back(Parameter("tau", 10.0, 10.0, Parameter::Double, ui->tau_SpinBox_2));
 
     parameter.push_back(p);
     p.parameter.clear();
@@ -391,6 +421,13 @@ void MainWindow::setupParameter() {
     p.parameter.push_back(Parameter("plot", true, true, Parameter::Bool, ui->runPlot_checkBox));
     p.parameter.push_back(Parameter("off", 10.0, 10.0, Parameter::Double, ui->runOff_doubleSpinBox));
     p.parameter.push_back(Parameter("time", 30.0, 30.0, Parameter::Double, ui->runTime_doubleSpinBox));
+    p.parameter.push_back(Parameter("stats", false, false, Parameter::Bool, ui->runStats_checkBox));
+    rdbuttons = new QVector<QRadioButton*>();
+    rdbuttons->push_back(ui->runMean_radioButton);
+    rdbuttons->push_back(ui->runSd_radioButton);
+    rdbuttons->push_back(ui->runMin_radioButton);
+    rdbuttons->push_back(ui->runMax_radioButton);
+    p.parameter.push_back(Parameter("statistic", 0, 0, Parameter::Set, (QWidget*) rdbuttons));
 
     HEKAparameter.push_back(p);
     p.parameter.clear();
@@ -418,7 +455,15 @@ void MainWindow::setupParameter() {
     p.parameter.push_back(Parameter("fmax", 50.0, 50.0, Parameter::Double, ui->resonanceFmax_doubleSpinBox));
     p.parameter.push_back(Parameter("peak", 1.0, 1.0, Parameter::Double, ui->resonancePeak_doubleSpinBox));
     p.parameter.push_back(Parameter("smooth", 1, 1, Parameter::Integer, ui->resonanceSmooth_spinBox));
+    rdbuttons = new QVector<QRadioButton*>();
+    rdbuttons->push_back(ui->resonanceBoxcar_radioButton);
+    rdbuttons->push_back(ui->resonanceAverage_radioButton);
+    rdbuttons->push_back(ui->resonanceGaussian_radioButton);
+    rdbuttons->push_back(ui->resonanceGolay_radioButton);
+    p.parameter.push_back(Parameter("window", SmoothBoxcar, SmoothBoxcar, Parameter::Set, (QWidget*) rdbuttons));
     p.parameter.push_back(Parameter("zero", 0.0, 0.0, Parameter::Double, ui->resonanceZero_doubleSpinBox));
+    p.parameter.push_back(Parameter("tolerance", 0.0, 0.0, Parameter::Double, ui->resonanceTolerance_doubleSpinBox));
+    p.parameter.push_back(Parameter("lag", 0.0, 0.0, Parameter::Double, ui->resonanceMaxLag_doubleSpinBox));
     p.parameter.push_back(Parameter("update", true, true, Parameter::Bool, ui->resonanceUpdate_checkBox));
 
     HEKAparameter.push_back(p);
@@ -435,6 +480,9 @@ void MainWindow::setupParameter() {
     rdbuttons->push_back(ui->noiseSeedRandom_radioButton);
     p.parameter.push_back(Parameter("type", 0, 0, Parameter::Set, (QWidget*) rdbuttons));
     p.parameter.push_back(Parameter("seed", 0, 0, Parameter::Integer, ui->noiseSeed_spinBox));
+    p.parameter.push_back(Parameter("sta", false, false, Parameter::Bool, ui->noiseSTA_checkBox));
+    p.parameter.push_back(Parameter("threshold", 0.0, 0.0, Parameter::Double, ui->noiseThreshold_doubleSpinBox));
+    p.parameter.push_back(Parameter("window", 100.0, 100.0, Parameter::Double, ui->noiseWindow_doubleSpinBox));
 
     HEKAparameter.push_back(p);
     p.parameter.clear();
@@ -469,6 +517,8 @@ void MainWindow::setupParameter() {
     p.parameter.push_back(Parameter("HekaTemplatePath", "C:\\", "C:\\", Parameter::String, ui->hekaTemplatePath_lineEdit));
     p.parameter.push_back(Parameter("HekaDataPath", "C:\\", "C:\\", Parameter::String, ui->hekaDataPath_lineEdit));
     p.parameter.push_back(Parameter("template", "TemplateCreator", "TemplateCreator", Parameter::String, ui->template_lineEdit));
+    p.parameter.push_back(Parameter("int16_sequences", "", "", Parameter::String, ui->int16Sequences_lineEdit));
+    p.parameter.push_back(Parameter("int16_range", 10.0, 10.0, Parameter::Double, ui->int16Range_SpinBox));
 
     HEKAparameter.push_back(p);
     p.parameter.clear();
@@ -558,6 +608,18 @@ MainWindow::MainWindow(QWidget *parent) :
     //message window
     message_counter = 0;
 
+    data_from_base = false;
+    worker = 0;
+    worker_restart = false;
+    generation = 0;
+    pending_generation = 0;
+    stream_generation = -1;
+    key_generation = -1;
+    cached_generation = -1;
+    batch_running = false;
+    sta = 0;
+    sweep_stats = 0;
+
     update();
 
 
@@ -568,6 +630,11 @@ MainWindow::MainWindow(QWidget *parent) :
 
 MainWindow::~MainWindow()
 {
+    if (worker) {
+        worker->wait();
+        delete worker;
+    }
+
     DEBUG("destroy!")
 
     //write settings
@@ -656,6 +723,9 @@ void MainWindow::on_loadButton_clicked()
     //try to read data
     QString fileName = ui->filename_Edit->text();
 
+    data_from_base = false;
+    generation++;
+    updateTemplateFormat();
     if (heka.read_template_file(fileName, data)) {
         plotData();
     } else {
@@ -724,6 +794,16 @@ void MainWindow::on_reverseCheckBox_clicked()
     update();
 }
 
+void MainWindow::on_preciseCheckBox_clicked()
+{
+    update();
+}
+
+void MainWindow::on_multirateCheckBox_clicked()
+{
+    update();
+}
+
 
 //LPFnoise
 void MainWindow::on_createButton_2_clicked()
@@ -761,6 +841,26 @@ void MainWindow::on_sigma_SpinBox_2_editingFinished()
     update();
 }
 
+void MainWindow::on_alpha_SpinBox_2_editingFinished()
+{
+    update();
+}
+
+void MainWindow::on_psd_lineEdit_2_editingFinished()
+{
+    update();
+}
+
+void MainWindow::on_stream_checkBox_2_clicked()
+{
+    update();
+}
+
+void MainWindow::on_tau_SpinBox_2_editingFinished()
+{
+    update();
+}
+
 void MainWindow::on_seed_SpinBox_2_editingFinished()
 {
     update();
@@ -812,27 +912,57 @@ void MainWindow::on_readButton_clicked()
 //runs
 void MainWindow::on_run_pushButton_clicked()
 {
+    if (batchRunning("run")) return;
     runRun();
 }
 
 void MainWindow::on_runZap_pushButton_clicked()
 {
+    if (batchRunning("runZap")) return;
     runZap();
 }
 
 void MainWindow::on_runResonance_pushButton_clicked()
 {
-   runResonance();
+    if (batchRunning("runResonance")) return;
+    runResonance();
+}
+
+void MainWindow::on_resonanceSmooth_spinBox_valueChanged(int)
+{
+   smoothResonance(false);
+}
+
+void MainWindow::on_resonanceBoxcar_radioButton_clicked()
+{
+   smoothResonance(false);
+}
+
+void MainWindow::on_resonanceAverage_radioButton_clicked()
+{
+   smoothResonance(false);
+}
+
+void MainWindow::on_resonanceGaussian_radioButton_clicked()
+{
+   smoothResonance(false);
+}
+
+void MainWindow::on_resonanceGolay_radioButton_clicked()
+{
+   smoothResonance(false);
 }
 
 void MainWindow::on_runNoise_pushButton_clicked()
 {
-   runNoise();
+    if (batchRunning("runNoise")) return;
+    runNoise();
 }
 
 void MainWindow::on_runSin_pushButton_clicked()
 {
-       runSin();
+    if (batchRunning("runSin")) return;
+    runSin();
 }
 
 
@@ -946,8 +1076,15 @@ void MainWindow::update() {
 
     //check if we have to do something
     if (index() < 3 && last_parameter != parameter[index()]){
-        createData();
-        plotData();
+        // while a template is created in the background data is outdated, so no incremental updates
+        if (worker || !updateFromBase()) {
+            if (!createDataAsync()) {
+                createData();
+                plotData();
+            }
+        } else {
+            plotData();
+        }
         updateTemplateInfo();
 
         last_parameter = parameter[index()];
@@ -968,11 +1105,27 @@ void MainWindow::updateTemplateInfo() {
 
 // data
 void MainWindow::copyData(DataVECTOR& v){
-    v.resize(data.size());
-    copy (data.begin(), data.end(), v.begin());
+    DataVIEW d = dataView();
+    v.assign(d.begin(), d.end());
+}
+
+// the current template: data or the mapped template from the cache
+DataVIEW MainWindow::dataView() {
+    if (cached_generation == generation) return cached.view();
+    return DataVIEW(data);
+}
+
+// the template of key from the cache as data: the mapping is used instead of a copy in data
+bool MainWindow::lookupData(const QString& key) {
+    if (!cache.lookup(key, cached)) return false;
+    DataVECTOR().swap(data);
+    cached_generation = generation;
+    return true;
 }
 
 void MainWindow::setData(const DataVECTOR& v){
+    data_from_base = false;
+    generation++;
     data.resize(v.size());
     copy (v.begin(), v.end(), data.begin());
 }
@@ -983,13 +1136,37 @@ void MainWindow::saveData() {
 }
 
 void MainWindow::saveData(const QString& file_name) {
+    finishData();
     //create directory if not existent
     QDir().mkdir(QFileInfo(file_name).path());
 
-    bool res = heka.write_template_file(file_name, data);
+    updateTemplateFormat();
+    bool res;
+    if (stream_generation == generation) {
+        // data is the start of streamed noise only, the template is generated while it is written in chunks
+        NoiseParameter p;
+        res = noise_parameter_to_struct(stream_parameter, p);
+        p.file = file_name;
+        if (res) res = write_noise_stream(&heka, p, heka.template_int16_scale(file_name));
+    } else if (cached_generation == generation) {
+        // written straight from the mapped cache file
+        std::fstream file;
+        res = heka.open_template_file(file_name, file);
+        if (res) {
+            DataVIEW d = cached.view();
+            res = heka.write_template_data(file, d.begin(), d.size(), heka.template_int16_scale(file_name));
+            heka.close_template_file(file);
+        }
+    } else {
+        res = heka.write_template_file(file_name, data);
+        // only templates that are used are cached, editing does not write to the cache
+        if (res && key_generation == generation) cache.insert(data_key, data);
+    }
+    checkSaturation("saveData");
 
+    QString format = heka.template_int16_scale(file_name) != 0 ? " (int16)" : "";
     if (res)
-        ui->statusBar->showMessage("Saved Template to " + file_name, 2000 );
+        ui->statusBar->showMessage("Saved Template to " + file_name + format, 2000 );
     else
         ui->statusBar->showMessage("Could not save Template to " + file_name, 2000 );
 }
@@ -1014,95 +1191,201 @@ void MainWindow::createData() {
     DEBUG("create data")
 }
 
-bool MainWindow::createZap() {
-    DEBUG("create zap")
+// chunk size of streamed noise
+static const int stream_chunk = 1 << 16;
+
+// spectral shape of the noise parameter set p, reads the psd table if a file is given, no messages so that it
+// can be used by background generation
+static bool read_noise_shape(ParameterSet& p, NoiseShape& shape) {
+    shape.alpha = p["alpha"].value.toDouble();
+    shape.psd_f.clear();
+    shape.psd.clear();
+
+    QString psd = p["psd"].value.toString();
+    if (psd.isEmpty()) return true;
+
+    return shape.read_psd(psd.toStdString());
+}
+
+// template for the parameter set p of creator tab id with offset, margins and npad samples of padding
+// written in place into v, uses no widgets so that it can run in the background. Frozen noise is synthesized from
+// spectrum if given, otherwise its spectrum is drawn here, which uses rand() and must be on the GUI thread.
+// Returns false if it was aborted by cancel
+bool MainWindow::createBody(int id, ParameterSet& p, int npad, DataVECTOR& v, NoiseWorkspace* spectrum,
+                            const CancelFlag* cancel) {
+    double samp = p["sample"].value.toDouble();
+    double off = p["off"].value.toDouble();
+    double left = p["left"].value.toDouble();
+    double right = p["right"].value.toDouble();
+
+    if (id == ZapTab) {
+        int type = p["type"].value.toInt();
+        double dur = p["dur"].value.toDouble();
+        DataTYPE* body = prepare_template(samp, off, left, right, template_length(dur, samp), npad, v);
+
+        int factor = 1;
+        if (p["multirate"].value.toBool())
+            factor = multirate_factor(samp, std::max(p["f0"].value.toDouble(), p["f1"].value.toDouble()));
+
+        if (factor > 1) { // synthesized at a lower rate and interpolated
+            create_zap_multirate(type, dur, samp, p["f0"].value.toDouble(),  p["f1"].value.toDouble(),
+                                 p["amp"].value.toDouble(),  p["reverse"].value.toBool(), factor, off, body, cancel);
+        } else if (type == 0) { // linear zap
+            create_zap( dur, samp, p["f0"].value.toDouble(),  p["f1"].value.toDouble(),
+                        p["amp"].value.toDouble(),  p["reverse"].value.toBool(),
+                        off, body, p["precise"].value.toBool(), cancel );
+        } else if (type == 1) { // t^2 zap
+            create_zap_2( dur, samp, p["f0"].value.toDouble(),  p["f1"].value.toDouble(),
+                          p["amp"].value.toDouble(),  p["reverse"].value.toBool(),
+                          off, body, p["precise"].value.toBool(), cancel );
+        } else { // exp zap
+            create_zap_exp( dur, samp, p["f0"].value.toDouble(),  p["f1"].value.toDouble(),
+                            p["amp"].value.toDouble(),  p["reverse"].value.toBool(),
+                            off, body, p["precise"].value.toBool(), cancel );
+        }
 
-    int type = parameter[ZapTab]["type"].value.toInt();
+    } else if (id == NoiseTab) {
+        int process = p["process"].value.toInt();
+        if (process != 0) {
+            double dur = p["dur"].value.toDouble();
+            DataTYPE* body = prepare_template(samp, off, left, right, noise_length(dur, samp), npad, v);
+            if (process == 1) {
+                create_ou_noise(dur, samp, p["tau"].value.toDouble(), p["sigma"].value.toDouble(),
+                                p["seed"].value.toInt(), off, body, true, cancel);
+            } else {
+                create_filtered_noise(dur, samp, p["f1"].value.toDouble(), p["sigma"].value.toDouble(),
+                                      p["seed"].value.toInt(), off, body, true, cancel);
+            }
+            return !(cancel && *cancel);
+        }
 
-    bool suc;
-    if (type == 0) { // linear zap
-        suc = create_zap( parameter[ZapTab]["dur"].value.toDouble(),  parameter[ZapTab]["sample"].value.toDouble(),
-                           parameter[ZapTab]["f0"].value.toDouble(),  parameter[ZapTab]["f1"].value.toDouble(),
-                           parameter[ZapTab]["amp"].value.toDouble(),  parameter[ZapTab]["reverse"].value.toBool(),
-                           data );
+        NoiseShape shape;
+        if (!read_noise_shape(p, shape)) return false;
+
+        if (p["stream"].value.toBool()) {
+            DataTYPE* body = prepare_template(samp, off, left, right, noise_length(p["dur"].value.toDouble(), samp), npad, v);
+            NoiseStream stream(samp, p["f"].value.toDouble(), p["phase"].value.toDouble(), p["amp"].value.toDouble(),
+                               p["f0"].value.toDouble(), p["f1"].value.toDouble(), p["sigma"].value.toDouble(),
+                               p["seed"].value.toInt(), off, &shape);
+            // read block wise, so that a cancel is noticed
+            int n = noise_length(p["dur"].value.toDouble(), samp);
+            for (int i = 0; i < n && !(cancel && *cancel); i += stream_chunk) {
+                stream.read(body + i, std::min(stream_chunk, n - i));
+            }
+            return !(cancel && *cancel);
+        }
 
-    } else if (type == 1) { // t^2 zap
-        suc = create_zap_2( parameter[ZapTab]["dur"].value.toDouble(),  parameter[ZapTab]["sample"].value.toDouble(),
-                               parameter[ZapTab]["f0"].value.toDouble(),  parameter[ZapTab]["f1"].value.toDouble(),
-                               parameter[ZapTab]["amp"].value.toDouble(),  parameter[ZapTab]["reverse"].value.toBool(),
-                               data );
-    } else { // exp zap
-        suc = create_zap_exp( parameter[ZapTab]["dur"].value.toDouble(),  parameter[ZapTab]["sample"].value.toDouble(),
-                               parameter[ZapTab]["f0"].value.toDouble(),  parameter[ZapTab]["f1"].value.toDouble(),
-                               parameter[ZapTab]["amp"].value.toDouble(),  parameter[ZapTab]["reverse"].value.toBool(),
-                               data );
-    }
+        NoiseWorkspace local;
+        NoiseWorkspace& w = spectrum ? *spectrum : local;
+        if (!spectrum) {
+            w.setup(p["dur"].value.toDouble(), samp);
+            create_noise_spectrum(p["dur"].value.toDouble(), p["f0"].value.toDouble(), p["f1"].value.toDouble(),
+                                  p["seed"].value.toInt(), w, &shape);
+        }
 
-    postprocess_template( parameter[ZapTab]["sample"].value.toDouble(), parameter[ZapTab]["off"].value.toDouble(),
-                          parameter[ZapTab]["left"].value.toDouble(), parameter[ZapTab]["right"].value.toDouble(),
-                          data );
+        DataTYPE* body = prepare_template(samp, off, left, right, w.n_final, npad, v);
+        synthesize_noise(samp, p["f"].value.toDouble(), p["phase"].value.toDouble(), p["amp"].value.toDouble(),
+                         p["sigma"].value.toDouble(), off, w, body, cancel);
 
+    } else { // SinTab
+        double dur = p["dur"].value.toDouble();
+        DataTYPE* body = prepare_template(samp, off, left, right, template_length(dur, samp), npad, v);
 
-    //add some additional offset at end for rounding problems
-    double off=parameter[ZapTab]["off"].value.toDouble();
-    for (int i =0; i<100; i++) {
-        data.push_back(off);
+        create_sin(dur, samp,
+                   p["f"].value.toDouble(), p["phase"].value.toDouble(), p["amp"].value.toDouble(),
+                   p["f2"].value.toDouble(), p["phase2"].value.toDouble(), p["amp2"].value.toDouble(),
+                   p["positive"].value.toBool(),
+                   off, body, cancel);
     }
 
-    /*
-    bool zap = create_zap(ui-> dur_SpinBox->value(),  ui->sample_SpinBox->value(),
-                          ui->f0_SpinBox->value(), ui->f1_SpinBox->value(), ui->amp_SpinBox->value(), ui->reverseCheckBox->isChecked(),
-                          data);
-    postprocess_template(ui->sample_SpinBox->value(), ui->off_SpinBox->value(), ui->left_SpinBox->value(), ui->right_SpinBox->value(),
-                             data);
-    */
-
+    return !(cancel && *cancel);
+}
 
 
-    DEBUG("create zap done !")
+bool MainWindow::createZap() {
+    DEBUG("create zap")
+    data_from_base = false;
+    generation++;
 
+    QString key = TemplateCache::key(parameter[ZapTab].toKeyString());
+    if (lookupData(key)) {
+        ui->statusBar->showMessage("Zap loaded from cache", 2000 );
+        return true;
+    }
 
+    bool suc = createBody(ZapTab, parameter[ZapTab], TEMPLATE_PADDING, data);
 
+    DEBUG("create zap done !")
 
-    if (suc)
-        ui->statusBar->showMessage("Zap created", 2000 );
-    else
+    if (suc) {
+        data_key = key;
+        key_generation = generation;
+    }
+
+
+    double fmax = std::max(parameter[ZapTab]["f0"].value.toDouble(), parameter[ZapTab]["f1"].value.toDouble());
+    int factor = parameter[ZapTab]["multirate"].value.toBool() ? multirate_factor(parameter[ZapTab]["sample"].value.toDouble(), fmax) : 1;
+
+    if (suc && factor > 1) {
+        double err = multirate_error(factor, parameter[ZapTab]["sample"].value.toDouble(), fmax)
+                     * fabs(parameter[ZapTab]["amp"].value.toDouble());
+        ui->statusBar->showMessage(QString("Zap created at 1/%1 rate, max interpolation error %2").arg(factor).arg(err), 2000 );
+    } else if (suc) {
+        double err = zap_phase_error(parameter[ZapTab]["type"].value.toInt(), parameter[ZapTab]["dur"].value.toDouble(),
+                                     parameter[ZapTab]["sample"].value.toDouble(), parameter[ZapTab]["f0"].value.toDouble(),
+                                     parameter[ZapTab]["f1"].value.toDouble(), parameter[ZapTab]["reverse"].value.toBool(),
+                                     parameter[ZapTab]["precise"].value.toBool());
+        if (parameter[ZapTab]["precise"].value.toBool())
+            ui->statusBar->showMessage(QString("Zap created, max phase error %1 rad").arg(err), 2000 );
+        else
+            ui->statusBar->showMessage(QString("Zap created, estimated phase error %1 rad").arg(err), 2000 );
+    } else
         ui->statusBar->showMessage("Could not create Zap!", 2000 );
 
     return suc;
 }
 
+// samples of streamed noise kept in data for the plot
+static const int stream_preview_samples = 1 << 20;
+
 bool MainWindow::createNoise() {
 
     DEBUG("create noise !")
-    bool suc = create_noise(parameter[NoiseTab]["dur"].value.toDouble(), parameter[NoiseTab]["sample"].value.toDouble(),
-                     parameter[NoiseTab]["f"].value.toDouble(), parameter[NoiseTab]["phase"].value.toDouble(), parameter[NoiseTab]["amp"].value.toDouble(),
-                     parameter[NoiseTab]["f0"].value.toDouble(), parameter[NoiseTab]["f1"].value.toDouble(), parameter[NoiseTab]["sigma"].value.toDouble(), parameter[NoiseTab]["seed"].value.toInt(),
-                     data);
-
-
-    postprocess_template(parameter[NoiseTab]["sample"].value.toDouble(), parameter[NoiseTab]["off"].value.toDouble(),
-                         parameter[NoiseTab]["left"].value.toDouble(), parameter[NoiseTab]["right"].value.toDouble(),
-                         data );
-
-    double off = parameter[NoiseTab]["off"].value.toDouble();
-    for (int i =0; i<100; i++) {
-        data.push_back(off);
+    data_from_base = false;
+    generation++;
+
+    if (streamedNoise(parameter[NoiseTab])) {
+        // bounded memory: only the start is created, saveData writes the whole template in chunks
+        ParameterSet p(parameter[NoiseTab]);
+        double samp = p["sample"].value.toDouble();
+        double dur = std::min(p["dur"].value.toDouble(), stream_preview_samples / samp / 1000.0);
+        p["dur"].value = dur;
+        p["right"].value = 0.0;
+
+        bool suc = createBody(NoiseTab, p, 0, data);
+        if (suc) {
+            stream_generation = generation;
+            stream_parameter = parameter[NoiseTab];
+            ui->statusBar->showMessage(QString("Noise stream, first %1 s created, written in chunks when saved").arg(dur), 2000 );
+        } else {
+            ui->statusBar->showMessage("Could not create Noise!", 2000 );
+        }
+        return suc;
     }
 
+    QString key = noiseKey(parameter[NoiseTab]);
+    if (lookupData(key)) {
+        ui->statusBar->showMessage("Noise loaded from cache", 2000 );
+        return true;
+    }
 
+    bool suc = createBody(NoiseTab, parameter[NoiseTab], TEMPLATE_PADDING, data);
 
-    /*
-    bool noise = create_noise(ui->dur_SpinBox->value(), ui->sample_SpinBox->value(),
-                     ui->omega_SpinBox_2->value(), ui->phase_SpinBox_2->value(), ui->amp_SpinBox_2->value(),
-                     ui->f0_SpinBox_2->value(), ui->f1_SpinBox_2->value(), ui->sigma_SpinBox_2->value(), ui->seed_SpinBox_2->value(),
-                     data);
-    postprocess_template(ui->sample_SpinBox->value(), ui->off_SpinBox->value(), ui->left_SpinBox->value(), ui->right_SpinBox->value(),
-                             data);
-    */
     DEBUG("create noise done !")
 
     if (suc) {
+        data_key = key;
+        key_generation = generation;
         ui->statusBar->showMessage("Noise created", 2000 );
     } else {
         ui->statusBar->showMessage("Could not create Noise!", 2000 );
@@ -1112,9 +1395,182 @@ bool MainWindow::createNoise() {
 }
 
 
-bool MainWindow::createSin() {
+// two-tier creation of large templates: a preview at reduced sampling rate is plotted right away, the full rate
+// template is created in the background and committed to data when done. Edits meanwhile cancel the running one,
+// which stops at its next block, and restart it with the latest parameter, outdated results are dropped.
+
+// templates with more samples are created in the background
+static const int async_samples = 1 << 20;
+
+// samples of the preview
+static const int preview_samples = 20000;
+
+class TemplateWorker : public QThread {
+public:
+    TemplateWorker(MainWindow* w, int id, const ParameterSet& p, const QString& key, int generation)
+        : window(w), id(id), parameter(p), key(key), generation(generation), suc(false), done(false),
+          cancel(false), has_spectrum(false) {}
+
+    void run() {
+        suc = window->createBody(id, parameter, TEMPLATE_PADDING, v, has_spectrum ? &spectrum : 0, &cancel);
+        done = true;
+    }
+
+    MainWindow* window;
+    int id;
+    ParameterSet parameter;
+    QString key;
+    int generation;
+    bool suc;
+    DataVECTOR v;
+    volatile bool done;
+
+    // set from the GUI thread when the template is outdated
+    CancelFlag cancel;
+
+    // spectrum of frozen noise, drawn on the GUI thread
+    NoiseWorkspace spectrum;
+    bool has_spectrum;
+};
+
+QString MainWindow::templateKey(int id, ParameterSet& p) {
+    if (id == NoiseTab) return noiseKey(p);
+    return TemplateCache::key(p.toKeyString());
+}
+
+bool MainWindow::createDataAsync() {
+    int id = index();
+    if (id == SinTab) updateSinDuration();
+    ParameterSet& p = parameter[id];
+    if (id == NoiseTab && streamedNoise(p)) return false;
+
+    double samp = p["sample"].value.toDouble();
+    double length = p["dur"].value.toDouble() + p["left"].value.toDouble() + p["right"].value.toDouble();
+    if (length * samp * 1000 < async_samples) return false;
+
+    generation++;
+    data_from_base = false;
+
+    QString key = templateKey(id, p);
+    if (lookupData(key)) {
+        plotData();
+        ui->statusBar->showMessage("Template loaded from cache", 2000 );
+        return true;
+    }
+
+    ParameterSet pp(p);
+    pp["sample"].value = preview_samples / length / 1000.0;
+    DataVECTOR v;
+    if (createBody(id, pp, 0, v)) plotData(v, 1.0 / pp["sample"].value.toDouble() / 1000.0);
+    ui->statusBar->showMessage("Preview, creating template ...");
+
+    pending_id = id;
+    pending_parameter = p;
+    pending_key = key;
+    pending_generation = generation;
+    if (worker) {
+        worker->cancel = true;
+        worker_restart = true;
+    } else {
+        startWorker();
+    }
+
+    return true;
+}
+
+void MainWindow::startWorker() {
+    worker = new TemplateWorker(this, pending_id, pending_parameter, pending_key, pending_generation);
+
+    // rand() is not thread safe, so the random phases of frozen noise are drawn here and not by the worker,
+    // otherwise other noise created meanwhile on this thread would change the templates of their seeds
+    ParameterSet& p = worker->parameter;
+    if (pending_id == NoiseTab && p["process"].value.toInt() == 0 && !p["stream"].value.toBool()) {
+        NoiseShape shape;
+        if (read_noise_shape(p, shape)) {
+            double dur = p["dur"].value.toDouble();
+            worker->spectrum.setup(dur, p["sample"].value.toDouble());
+            create_noise_spectrum(dur, p["f0"].value.toDouble(), p["f1"].value.toDouble(), p["seed"].value.toInt(),
+                                  worker->spectrum, &shape);
+            worker->has_spectrum = true;
+        }
+    }
 
+    connect(worker, SIGNAL(finished()), this, SLOT(templateFinished()));
+    worker->start();
+}
+
+void MainWindow::templateFinished() {
+    // the worker of this signal may have been committed by finishData already
+    if (!worker || !worker->done) return;
+    worker->wait();
+
+    TemplateWorker* w = worker;
+    worker = 0;
+
+    if (w->generation == generation) {
+        if (w->suc) {
+            data.swap(w->v);
+            data_from_base = false;
+            data_key = w->key;
+            key_generation = generation;
+            plotData();
+            ui->statusBar->showMessage("Template created", 2000 );
+        } else {
+            ui->statusBar->showMessage("Could not create template!", 2000 );
+        }
+    }
+    w->deleteLater();
+
+    // restart with the latest parameter unless data was replaced meanwhile
+    if (worker_restart) {
+        worker_restart = false;
+        if (pending_generation == generation) startWorker();
+    }
+}
 
+// waits for the template created in the background, if any, and commits it. No events are processed meanwhile,
+// so nothing can start or change the data while the caller is in the middle of using it
+void MainWindow::finishData() {
+    while (worker) {
+        if (worker->generation != generation) worker->cancel = true;
+        worker->wait();
+        templateFinished();
+    }
+}
+
+
+// stimulus from the formula of the expression tab, duration, sampling, offset and margins as for the other templates
+bool MainWindow::createExpression() {
+    DEBUG("create expression")
+    data_from_base = false;
+    generation++;
+
+    std::map<std::string, double> constants;
+    std::string err;
+    if (!Expression::parse_constants(ui->expression_constants_lineEdit->text().toStdString(), constants, err)) {
+        error_message("createExpression", QString("Cannot parse constants: %1").arg(QString::fromStdString(err)));
+        return false;
+    }
+
+    Expression e;
+    if (!e.compile(ui->expression_lineEdit->text().toStdString(), constants, err)) {
+        error_message("createExpression", QString("Cannot parse expression: %1").arg(QString::fromStdString(err)));
+        return false;
+    }
+
+    double dur = ui->dur_SpinBox->value();
+    double samp = ui->sample_SpinBox->value();
+    double off = ui->off_SpinBox->value();
+    DataTYPE* body = prepare_template(samp, off, ui->left_SpinBox->value(), ui->right_SpinBox->value(),
+                                      template_length(dur, samp), TEMPLATE_PADDING, data);
+    e.create(dur, samp, off, body);
+
+    ui->statusBar->showMessage("Expression created", 2000 );
+    return true;
+}
+
+
+void MainWindow::updateSinDuration() {
     if (parameter[SinTab]["peaks"].value.toBool() && parameter[SinTab]["f"].value.toDouble() !=0) {
         parameter[SinTab]["dur"].value = parameter[SinTab]["npeaks"].value.toDouble() / parameter[SinTab]["f"].value.toDouble();
         parameter[SinTab]["dur"].to_widget();
@@ -1123,27 +1579,29 @@ bool MainWindow::createSin() {
         parameter[SinTab]["dur"].value = parameter[SinTab]["npeaks2"].value.toDouble() / parameter[SinTab]["f2"].value.toDouble();
         parameter[SinTab]["dur"].to_widget();
     }
+}
 
-    DEBUG("create sin !")
-    bool suc = create_sin(parameter[SinTab]["dur"].value.toDouble(), parameter[SinTab]["sample"].value.toDouble(),
-                    parameter[SinTab]["f"].value.toDouble(), parameter[SinTab]["phase"].value.toDouble(), parameter[SinTab]["amp"].value.toDouble(),
-                    parameter[SinTab]["f2"].value.toDouble(), parameter[SinTab]["phase2"].value.toDouble(), parameter[SinTab]["amp2"].value.toDouble(),
-                    parameter[SinTab]["positive"].value.toBool(),
-                     data);
+bool MainWindow::createSin() {
 
+    updateSinDuration();
 
-    postprocess_template(parameter[SinTab]["sample"].value.toDouble(), parameter[SinTab]["off"].value.toDouble(),
-                         parameter[SinTab]["left"].value.toDouble(), parameter[SinTab]["right"].value.toDouble(),
-                         data );
+    DEBUG("create sin !")
+    data_from_base = false;
+    generation++;
 
-    double off=parameter[SinTab]["off"].value.toDouble();
-    for (int i =0; i<100; i++) {
-        data.push_back(off);
+    QString key = TemplateCache::key(parameter[SinTab].toKeyString());
+    if (lookupData(key)) {
+        ui->statusBar->showMessage("Sin loaded from cache", 2000 );
+        return true;
     }
 
+    bool suc = createBody(SinTab, parameter[SinTab], TEMPLATE_PADDING, data);
+
     DEBUG("sin noise done !")
 
     if (suc) {
+        data_key = key;
+        key_generation = generation;
         ui->statusBar->showMessage("Sin created", 2000 );
     } else {
         ui->statusBar->showMessage("Could not create Sin!", 2000 );
@@ -1154,6 +1612,100 @@ bool MainWindow::createSin() {
 
 
 
+bool MainWindow::noiseShape(ParameterSet& p, NoiseShape& shape) {
+    if (!read_noise_shape(p, shape)) {
+        error_message("noiseShape", QString("Cannot read power spectral density table: %1").arg(p["psd"].value.toString()));
+        return false;
+    }
+    return true;
+}
+
+// noise parameter set p of frozen noise synthesized as a stream
+bool MainWindow::streamedNoise(ParameterSet& p) {
+    return p["stream"].value.toBool() && p["process"].value.toInt() == 0;
+}
+
+// cache key of the noise parameter set p, a psd table is identified by size and modification time of its file
+QString MainWindow::noiseKey(ParameterSet& p) {
+    QString str = p.toKeyString();
+    QString psd = p["psd"].value.toString();
+    if (!psd.isEmpty()) {
+        QFileInfo info(psd);
+        str = QString("%1,psdfile=%2:%3").arg(str).arg(info.size()).arg(info.lastModified().toString(Qt::ISODate));
+    }
+    return TemplateCache::key(str);
+}
+
+
+
+// incremental updates: amplitude, offset and margins are applied to a stored unscaled template body
+
+// the amplitude that scales the whole template body for parameters p of tab id, 0 if there is none
+double MainWindow::templateScale(int id, ParameterSet& p) {
+    if (id == ZapTab) return p["amp"].value.toDouble();
+    if (id == SinTab && !p["positive"].value.toBool() && p["amp2"].value.toDouble() == 0)
+        return p["amp"].value.toDouble();
+    return 0;
+}
+
+// parameters p of tab id with unit amplitude, no offset and no margins -> the parameters of the body
+ParameterSet MainWindow::baseParameter(int id, const ParameterSet& p) {
+    ParameterSet b(p);
+    if (templateScale(id, b) != 0) b["amp"].value = 1.0;
+    b["off"].value = 0.0;
+    b["left"].value = 0.0;
+    b["right"].value = 0.0;
+    b["file"].value = "";
+    return b;
+}
+
+bool MainWindow::updateFromBase() {
+    int id = index();
+    if (id == SinTab) updateSinDuration();
+    if (id == NoiseTab && streamedNoise(parameter[id])) return false;
+
+    ParameterSet p = baseParameter(id, parameter[id]);
+
+    if (base_parameter != p) {
+        // only build a new body if the last change was incremental, otherwise create the template directly
+        if (last_parameter.name != p.name || baseParameter(id, last_parameter) != p) return false;
+
+        DEBUG("create base")
+        if (!createBody(id, p, 0, base)) return false;
+        base_parameter = p;
+        data_from_base = false;
+    }
+
+    double scale = templateScale(id, parameter[id]);
+    if (scale == 0) scale = 1;
+    DataTYPE off = parameter[id]["off"].value.toDouble();
+    int nl, nr;
+    template_margins(parameter[id]["sample"].value.toDouble(), parameter[id]["left"].value.toDouble(),
+                     parameter[id]["right"].value.toDouble(), nl, nr);
+    nr += TEMPLATE_PADDING;
+
+    if (data_from_base && DataTYPE(scale) == data_scale && off == data_off) {
+        // margins only: O(margin) edits
+        if (nl > data_nl) data.insert(data.begin(), nl - data_nl, off);
+        if (nl < data_nl) data.erase(data.begin(), data.begin() + (data_nl - nl));
+        data.resize(nl + base.size() + nr, off);
+    } else {
+        scale_offset_template(base, scale, off, nl, nr, data);
+    }
+
+    // data was replaced, it is no longer the template of its cache key
+    generation++;
+    data_from_base = true;
+    data_scale = scale;
+    data_off = off;
+    data_nl = nl;
+
+    ui->statusBar->showMessage("Template updated", 2000 );
+    return true;
+}
+
+
+
 
 
 // a simple plotting routine
@@ -1163,23 +1715,28 @@ void MainWindow::plotData() {
 }
 
 void MainWindow::plotData(double dt)
+{
+    plotData(dataView(), dt);
+}
+
+void MainWindow::plotData(const DataVIEW& v, double dt)
 {
     DEBUG("plotData")
 
     // reduce data
     //graphWidget->width();
-    int plotpoints = data.size() < 10000 ?  data.size() : 10000;
-    double dindex = double(data.size()) / plotpoints;
+    int plotpoints = v.size() < 10000 ?  v.size() : 10000;
+    double dindex = double(v.size()) / plotpoints;
     double index= 0;
 
-    int n = floor(double(data.size()) / dindex);
+    int n = plotpoints > 0 ? floor(double(v.size()) / dindex) : 0;
 
     x.resize(n);
     y.resize(n);
 
     for (int i = 0; i < n; i++) {
         x[i] = floor(index) * dt;
-        y[i] = data[int(floor(index))];
+        y[i] = v[int(floor(index))];
         index += dindex;
     }
 
@@ -1203,6 +1760,21 @@ void MainWindow::plotData(double dt)
     DEBUG("plotData!")
 }
 
+// step protocols are plotted at their breakpoints without expanding them
+void MainWindow::plotSteps(const StepProtocol& steps)
+{
+    std::vector<double> t, l;
+    steps.breakpoints(t, l);
+
+    x = QVector<double>::fromStdVector(t);
+    y = QVector<double>::fromStdVector(l);
+
+    graphWidget->graph(0)->setPen(QPen(Qt::blue));
+    graphWidget->graph(0)->setData(x, y);
+    graphWidget->graph(0)->rescaleAxes();
+    graphWidget->replot();
+}
+
 
 
 
@@ -1228,6 +1800,23 @@ void MainWindow::updateHEKA(){
     heka.batch_message_file_name = HEKAparameter[Settings]["file_out"].value.toString();
     heka.batch_id =  HEKAparameter[Settings]["id"].value.toInt();
     heka.batch_wait =  HEKAparameter[Settings]["wait"].value.toDouble();
+
+    updateTemplateFormat();
+}
+
+// which templates are written and read as int16, see Heka::template_int16_scale
+void MainWindow::updateTemplateFormat(){
+    HEKAparameter[Settings].from_widgets();
+    QString seqs = HEKAparameter[Settings]["int16_sequences"].value.toString();
+    heka.int16_sequences = seqs.split(QRegExp("[\\s,;]+"), QString::SkipEmptyParts);
+    heka.int16_range = HEKAparameter[Settings]["int16_range"].value.toDouble();
+}
+
+void MainWindow::checkSaturation(const QString& routine){
+    int n = heka.int16_saturated.fetchAndStoreRelaxed(0);
+    if (n > 0) {
+        error_message(routine, QString("%1 samples clipped to the int16 range, increase the int16 full scale").arg(n));
+    }
 }
 
 void MainWindow::updateHEKABatchId(){
@@ -1279,14 +1868,56 @@ void MainWindow::noise_parameter_to_comment(QString& comment) {
         c = QString("%1; %2").arg(c).arg(parameter[NoiseTab].parameter[i].toString());
     }
 
+    //shaped, streamed or filtered noise only, so comments of flat noise stay as they were
+    bool filtered = parameter[NoiseTab]["process"].value.toInt() != 0;
+    if (parameter[NoiseTab]["alpha"].value.toDouble() != 0 || !parameter[NoiseTab]["psd"].value.toString().isEmpty()
+        || parameter[NoiseTab]["stream"].value.toBool() || filtered) {
+        c = QString("%1; %2").arg(c).arg(parameter[NoiseTab]["alpha"].toString());
+        c = QString("%1; %2").arg(c).arg(parameter[NoiseTab]["psd"].toString());
+        c = QString("%1; %2").arg(c).arg(parameter[NoiseTab]["stream"].toString());
+    }
+    if (filtered) {
+        c = QString("%1; %2").arg(c).arg(parameter[NoiseTab]["process"].toString());
+        c = QString("%1; %2").arg(c).arg(parameter[NoiseTab]["tau"].toString());
+    }
+
     comment = c;
 }
 
 
+bool MainWindow::noise_parameter_to_struct(NoiseParameter& p) {
+    return noise_parameter_to_struct(parameter[NoiseTab], p);
+}
+
+bool MainWindow::noise_parameter_to_struct(ParameterSet& ps, NoiseParameter& p) {
+    p.dur = ps["dur"].value.toDouble();
+    p.sample = ps["sample"].value.toDouble();
+    p.f = ps["f"].value.toDouble();
+    p.phase = ps["phase"].value.toDouble();
+    p.amp = ps["amp"].value.toDouble();
+    p.f0 = ps["f0"].value.toDouble();
+    p.f1 = ps["f1"].value.toDouble();
+    p.sigma = ps["sigma"].value.toDouble();
+    p.seed = ps["seed"].value.toInt();
+    p.off = ps["off"].value.toDouble();
+    p.left = ps["left"].value.toDouble();
+    p.right = ps["right"].value.toDouble();
+    p.file = ps["file"].value.toString();
+    p.process = ps["process"].value.toInt();
+    p.tau = ps["tau"].value.toDouble();
+    p.stream = ps["stream"].value.toBool() && p.process == 0;
+    return noiseShape(ps, p.shape);
+}
+
+
 bool MainWindow::noise_parameter_from_comment(const QString& comment) {
+    return noise_parameter_from_comment(comment, parameter[NoiseTab]);
+}
+
+bool MainWindow::noise_parameter_from_comment(const QString& comment, ParameterSet& ps) {
     QStringList list = comment.split(QRegExp("(;\\s)(\\s)*"), QString::SkipEmptyParts);
 
-    if (list.size() != 13) {
+    if (list.size() != 13 && list.size() != 15 && list.size() != 16 && list.size() != 18) {
         error_message("noise_parameter_from_comment", QString("Cannot parse comment to Noise: %1").arg(comment));
         return false;
     }
@@ -1298,7 +1929,7 @@ bool MainWindow::noise_parameter_from_comment(const QString& comment) {
 
     bool ok;
     for (int i = 0; i < 12; i++) {
-        parameter[NoiseTab].parameter[i].from_string(list[i+1], &ok);
+        ps.parameter[i].from_string(list[i+1], &ok);
 
         if (!ok) {
             error_message("noise_parameter_from_comment", QString("Cannot parse comment to Noise: %1").arg(comment));
@@ -1306,6 +1937,27 @@ bool MainWindow::noise_parameter_from_comment(const QString& comment) {
         }
     }
 
+    //shaped, streamed or filtered noise
+    ps["alpha"].value = 0.0;
+    ps["psd"].value = "";
+    ps["stream"].value = false;
+    ps["process"].value = 0;
+
+    if (list.size() >= 15) {
+        QString psd = list[14];
+        if (psd.startsWith("\"") && psd.endsWith("\"")) psd = psd.mid(1, psd.size()-2);
+
+        ps["alpha"].from_string(list[13], &ok);
+        if (ok) ps["psd"].from_string(psd, &ok);
+        if (ok && list.size() >= 16) ps["stream"].from_string(list[15], &ok);
+        if (ok && list.size() == 18) ps["process"].from_string(list[16], &ok);
+        if (ok && list.size() == 18) ps["tau"].from_string(list[17], &ok);
+        if (!ok) {
+            error_message("noise_parameter_from_comment", QString("Cannot parse comment to Noise: %1").arg(comment));
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -1459,6 +2111,41 @@ bool MainWindow::createTemplateSequence(const QString& name, double dur, int nsw
         return suc;
 }
 
+//create a sequence playing a piecewise constant step protocol with HEKA segments directly, no template needed
+bool MainWindow::createStepSequence(const QString& name, const StepProtocol& steps, int nsweep) {
+        if (!steps.constant()) {
+            error_message("createStepSequence", QString("step protocol %1 has ramps, use a template").arg(name));
+            return false;
+        }
+
+        updateHEKA();
+
+        Heka::Sequence seq;
+        seq.source = HEKAparameter[Settings]["template"].value.toString();
+        seq.name = name;
+        seq.interval = 0.0;
+        seq.sweepno = nsweep;
+        seq.trigger = 0;
+
+        const std::vector<StepSegment>& segment = steps.segments();
+        for (int i = 0; i < int(segment.size()); i++) {
+            Heka::Segment seg;
+            seg.dur = segment[i].dur;
+            seg.amp = segment[i].level;
+            seq.segment.push_back(seg);
+        }
+
+        heka.delete_sequence(name);
+
+        bool suc = heka.new_sequence(seq);
+        if (!suc) {
+            error_message("createStepSequence", QString("could not create: %1").arg(seq.toString()));
+        } else {
+            message("createStepSequence", QString("created: %1").arg(seq.toString()));
+        }
+        return suc;
+}
+
 
 
 
@@ -1495,15 +2182,18 @@ bool MainWindow::runHEKA(const QString& sequence, const QString& comment, double
     }
 
     //plot data
-    if (plot) {
-        //read zap
+    if (plot || sta || sweep_stats) {
+        //read zap, a template still created in the background is outdated now
+        data_from_base = false;
+        generation++;
         suc = heka.get_last_recorded_data(data);
         if (!suc) {
             error_message("run", "Could not read data for last sequence!");
             return false;
         }
 
-        plotData();
+        if (sta || sweep_stats) analyzeSweep(plot);
+        else plotData();
     }
 
     QCoreApplication::processEvents(QEventLoop::AllEvents, 50);
@@ -1518,6 +2208,43 @@ bool MainWindow::runHEKA(const QString& sequence, const QString& comment, double
 }
 
 
+// adds the sweep just recorded to the spike triggered average or the sweep statistics and shows the result so far
+void MainWindow::analyzeSweep(bool plot) {
+    if (sta) {
+        int n = sta->add(data, sta_threshold, 0, sta_refractory);
+        message("run", QString("sweep %1: %2 spikes, %3 in total").arg(sta->sweeps()).arg(n).arg(sta->spikes()));
+
+        if (plot) {
+            DataVECTOR average;
+            sta->average(average);
+            plotData(average, sta_dt);
+        }
+    }
+
+    if (sweep_stats) {
+        if (!sweep_stats->add(data)) {
+            error_message("run", QString("sweep of %1 samples is shorter than the first one, not added").arg(data.size()));
+        }
+
+        if (plot) {
+            DataVECTOR v;
+            sweepStatistic(*sweep_stats, v);
+            plotData(v, 1.0 / ui->sample_SpinBox->value() / 1000.0);
+        }
+    }
+}
+
+// the statistic chosen in the Run tab
+void MainWindow::sweepStatistic(const SweepStatistics& stats, DataVECTOR& v) {
+    switch (HEKAparameter[Run]["statistic"].value.toInt()) {
+        case 1: stats.sd(v); break;
+        case 2: stats.min(v); break;
+        case 3: stats.max(v); break;
+        default: stats.mean(v);
+    }
+}
+
+
 void MainWindow::runRun() {
     updateHEKA();
 
@@ -1527,7 +2254,22 @@ void MainWindow::runRun() {
     double off = HEKAparameter[Run]["off"].value.toDouble();
     double time = HEKAparameter[Run]["time"].value.toDouble();
 
-    runHEKA(sequence, "", off, time, plot, nrep);
+    if (HEKAparameter[Run]["stats"].value.toBool()) {
+        // the chosen statistic becomes the data, e.g. to save the mean response as template
+        SweepStatistics stats;
+        sweep_stats = &stats;
+        runHEKA(sequence, "", off, time, plot, nrep);
+        sweep_stats = 0;
+
+        if (stats.count() > 0) {
+            DataVECTOR v;
+            sweepStatistic(stats, v);
+            setData(v);
+            message("runRun", QString("statistics of %1 sweeps of %2 samples").arg(stats.count()).arg(stats.size()));
+        }
+    } else {
+        runHEKA(sequence, "", off, time, plot, nrep);
+    }
 
     updateHEKABatchId();
 }
@@ -1586,13 +2328,13 @@ void MainWindow::runResonance() {
 
 
     QString sequence = HEKAparameter[Resonance]["sequence"].value.toString();
-    bool plot = HEKAparameter[Resonance]["plot"].value.toBool();
 
     QString path = HEKAparameter[Settings]["HekaTemplatePath"].value.toString();
 
-    //get template file
+    //get template file, read into the buffers of the pipeline which keep their size between scans
 
-    DataVECTOR stim, resp;
+    DataVECTOR& stim = resonance.stimulus_buffer();
+    DataVECTOR& resp = resonance.response_buffer();
 
 
     //get template
@@ -1631,92 +2373,87 @@ void MainWindow::runResonance() {
     //read_template_file("E:/Science/Projects/LFPSpikes/Experiment/Patch/Test/zapout.tpl", resp);
 
 
-    int n1 = stim.size();
-    int n2 = resp.size();
+    ResonancePipeline::Settings& s = resonance.settings;
+    s.zero = HEKAparameter[Resonance]["zero"].value.toDouble();
+    s.tolerance = HEKAparameter[Resonance]["tolerance"].value.toDouble();
+    s.max_lag = int(HEKAparameter[Resonance]["lag"].value.toDouble() * parameter[ZapTab]["sample"].value.toDouble() + 0.5);
+    s.dur = HEKAparameter[Resonance]["dur"].value.toDouble();
+    s.fmax = HEKAparameter[Resonance]["fmax"].value.toDouble();
+    s.sample = parameter[ZapTab]["sample"].value.toDouble();
+
+    //equalize, remove on and offsets, align, truncate to good fft size, calculate and crop the impedance
+    bool analyzed = resonance.analyze();
+
+    int n1 = resonance.length_before();
+    int n2 = resonance.response_length_before();
     if (n1 != n2) {
         error_message("runResonance", QString("array sizes: %1, %2").arg(n1).arg(n2));
     } else {
         message("runResonance", QString("array sizes: %1, %2").arg(n1).arg(n2));
     }
+    message("runResonance", QString("offsets: %1, %2").arg(resonance.offset_first()).arg(resonance.offset_last()));
 
-    if (n1 < n2) {
-        remove_ends(resp,0, n2-n1);
-    }
-    if (n1 > n2) {
-        remove_ends(stim,0, n1-n2);
+    if (s.max_lag > 0) {
+        const Alignment& a = resonance.alignment();
+        if (a.valid) {
+            message("runResonance", QString("response latency: %1 ms, correlation %2")
+                                    .arg(a.delay / parameter[ZapTab]["sample"].value.toDouble()).arg(a.correlation));
+        } else {
+            message("runResonance", "could not align response to stimulus", QColor("red"));
+        }
     }
 
-    n1 = stim.size();
-    n2 = resp.size();
-    message("runResonance", QString("array sizes after equalizing: %1, %2").arg(n1).arg(n2));
-
-
-    //check for on and offsets in stimulus and remove
-    double zero = HEKAparameter[Resonance]["zero"].value.toDouble();
-    int pos1 = 0;
-    first_non_zero(stim, pos1, zero);
-    int pos2 = 0;
-    last_non_zero(stim, pos2, zero);
-
-    message("runResonance", QString("offsets: %1, %2").arg(pos1).arg(pos2));
-
-    //remove offsets
-    remove_ends(stim, pos1, pos2);
-    remove_ends(resp, pos1, pos2);
-
-    n1 = stim.size();
-    n2 = resp.size();
-    message("runResonance", QString("array sizes after removing offsets: %1, %2").arg(n1).arg(n2));
-
-    //find good fft size
-    n2 = find_good_smaller_fft_size(n1);
-    remove_ends(stim, 0, n1-n2);
-    remove_ends(resp, 0, n1-n2);
-
-    n1 = stim.size();
-    n2 = resp.size();
-    message("runResonance", QString("array sizes after truncating to good fft size: %1, %2").arg(n1).arg(n2));
+    message("runResonance", QString("array sizes after truncating to good fft size: %1, %1").arg(resonance.length()));
+    if (resonance.stimulus_reused()) message("runResonance", "stimulus spectrum reused");
 
+    if (!analyzed) {
+        error_message("runResonance", "no impedance left after trimming the data");
+        updateHEKABatchId();
+        return;
+    }
 
-    // calulate impedance
-    DataVECTOR imp;
-    impedance(stim, resp, imp);
+    //if (plot) plotData();
+    message("runResonance Info:", QString("np = %1, df = %2").arg(resonance.impedance().size()).arg(resonance.df()));
 
+    smoothResonance(true);
 
-    //number of relevant data points: maxf * dur
-    double dur = HEKAparameter[Resonance]["dur"].value.toDouble();
-    double maxf = HEKAparameter[Resonance]["fmax"].value.toDouble();
+    updateHEKABatchId();
+}
 
-    //zoom into relevant regime
-    int np = int(dur * maxf);
-    if (np > n1-5) np = n1-5;
-    remove_ends(imp, 5, n1-np-5);
+// smooth and plot the last impedance, if report detect resonance peaks
+void MainWindow::smoothResonance(bool report) {
+    if (resonance.impedance().empty()) return;
 
-    double df = 1.0/dur;
+    HEKAparameter[Resonance].from_widgets();
+    bool plot = HEKAparameter[Resonance]["plot"].value.toBool();
 
-    //if (plot) plotData();
-    message("runResonance Info:", QString("np = %1, df = %2").arg(np).arg(df));
+    ResonancePipeline::Settings& s = resonance.settings;
+    s.peak = HEKAparameter[Resonance]["peak"].value.toDouble();
+    s.width = HEKAparameter[Resonance]["smooth"].value.toInt();
+    s.window = HEKAparameter[Resonance]["window"].value.toInt();
 
-    //now detect resonance peaks:
-    double peak = HEKAparameter[Resonance]["peak"].value.toDouble();
-    double smooth = HEKAparameter[Resonance]["smooth"].value.toDouble();
+    if (!report) {
+        resonance.smooth_impedance();
+        setData(resonance.smoothed());
+        if (plot) plotData(resonance.smoothed_df());
+        return;
+    }
 
-    DataVECTOR imp_smooth;
-    smooth_data(imp, smooth, imp_smooth);
-    setData(imp_smooth);
-    df = df * smooth;
+    // model fit to the unsmoothed impedance, starts from the last fit
+    bool fitted = resonance.smooth();
+    setData(resonance.smoothed());
+    double df = resonance.smoothed_df();
     if (plot) plotData(df);
 
     //find
-    std::vector<int> pos;
-    find_peaks(imp_smooth, peak, pos, 100);
+    const std::vector<int>& pos = resonance.peak_positions();
 
     for (int i = 0; i < int(pos.size()); i++) message("runResonance", QString("found resonance peak at: %1").arg(pos[i]*df), QColor("green"));
     if ( int(pos.size()) == 0) {
         message("runResonance", QString("found resonance peak at: 0.0"), QColor("green"));
     }
-    if (int(pos.size() ==100)) {
-        message("runResonance", QString("warning: found more than 100 peaks! Try to modify parameters."), QColor("red"));
+    if (int(pos.size()) == resonance.settings.max_peaks) {
+        message("runResonance", QString("warning: found more than %1 peaks! Try to modify parameters.").arg(resonance.settings.max_peaks), QColor("red"));
     } else {
         message("runResonance", QString("in total: %1 peak(s)").arg(pos.size()), QColor("green"));
     }
@@ -1727,12 +2464,34 @@ void MainWindow::runResonance() {
         f_guess = (*(pos.end()-1)) * df; // take last - alternatively we could average here!!
     }
 
+    // the fit is preferred over the peaks if it resonates
+    if (fitted) {
+        const ResonanceFit& fit = resonance.resonance_fit();
+        message("runResonance", QString("resonance fit: f = %1 +- %2 Hz, Q = %3 +- %4, R^2 = %5, %6 iterations")
+                                .arg(fit.fres).arg(fit.fres_err).arg(fit.q).arg(fit.q_err).arg(fit.r2).arg(fit.iterations),
+                QColor("green"));
+        if (fit.fres > 0) f_guess = fit.fres;
+
+        int k = int((fit.fres - resonance.first_frequency()) / resonance.df() + 0.5);
+        if (fit.fres > 0 && k >= 0 && k < resonance.phase().size()) {
+            message("runResonance", QString("impedance phase at resonance: %1 deg").arg(resonance.phase()[k] * 180 / 3.141592653589793),
+                    QColor("green"));
+        }
+    } else {
+        message("runResonance", "resonance fit did not converge, using the last peak", QColor("red"));
+    }
+
+    QString timing;
+    for (int i = 0; i < ResonancePipeline::NStages; i++) {
+        ResonancePipeline::Stage stage = ResonancePipeline::Stage(i);
+        timing += QString("%1%2 %3").arg(i ? ", " : "").arg(ResonancePipeline::stage_name(stage)).arg(resonance.time(stage));
+    }
+    message("runResonance", QString("timing [ms]: %1").arg(timing));
+
     if (update){  //update noise parameter
         parameter[NoiseTab]["f"].value = f_guess;
         parameter[NoiseTab]["f"].to_widget();
     }
-
-    updateHEKABatchId();
 }
 
 
@@ -1754,22 +2513,49 @@ void MainWindow::runNoise() {
     double time = dur + parameter[NoiseTab]["left"].value.toDouble()
                   + parameter[NoiseTab]["right"].value.toDouble();
 
+    // spike triggered average of frozen noise kept in memory, sweeps are then run and read one by one
+    bool streamed = streamedNoise(parameter[NoiseTab]);
+    bool analyze = HEKAparameter[Noise]["sta"].value.toBool();
+    if (analyze && (type != 0 || streamed)) {
+        message("runNoise", "spike triggered average only for frozen noise that is not streamed");
+        analyze = false;
+    }
 
     //create new sequence
-    createTemplateSequence(sequence, time, nrep);
+    createTemplateSequence(sequence, time, analyze ? 1 : nrep);
 
     //switch frozen or random noise
     if (type == 0) {// frozen noise
 
-        //create and write zap
+        QString filename = heka.sequence_to_template_file_name(sequence, path);
+
+        //create and write noise, streamed noise is written in chunks by saveData
         createNoise();
         plotData();
 
-        QString filename = heka.sequence_to_template_file_name(sequence, path);
         saveData(filename);
         // run HEKA
         noise_parameter_to_comment(comment);
-        runHEKA(sequence, comment, nrep * time, nrep * (time + 10), plot);
+        if (analyze) {
+            double samp = parameter[NoiseTab]["sample"].value.toDouble();
+            int nwin = int(HEKAparameter[Noise]["window"].value.toDouble() * samp);
+
+            DataVECTOR stimulus;
+            copyData(stimulus);
+            SpikeTriggeredAverage average(stimulus, nwin, nwin / 4 + 1);
+            sta = &average;
+            sta_threshold = HEKAparameter[Noise]["threshold"].value.toDouble();
+            sta_refractory = int(samp); // 1 ms
+            sta_dt = 1.0 / samp / 1000.0;
+
+            runHEKA(sequence, comment, time, time + 10, plot, nrep);
+            sta = 0;
+
+            message("runNoise", QString("spike triggered average of %1 spikes in %2 sweeps, %3 ms before the spike")
+                                .arg(average.spikes()).arg(average.sweeps()).arg(average.before() / samp));
+        } else {
+            runHEKA(sequence, comment, nrep * time, nrep * (time + 10), plot);
+        }
 
     } else {// noise repititions
 
@@ -1797,19 +2583,39 @@ void MainWindow::runNoise() {
         comment +=";"+QString("%1").arg(type);
 
 
-        //create different noise templates
+        //create different noise templates in parallel
+        NoiseBatch batch(&heka, &cache);
+        connect(&batch, SIGNAL(progress(int,int,double,double)), this, SLOT(batchProgress(int,int,double,double)));
+        NoiseParameter p;
+        if (!noise_parameter_to_struct(p)) {
+            updateHEKABatchId();
+            return;
+        }
+        ParameterSet ps(parameter[NoiseTab]);
         for (int i =0; i< nrep; i++) {
             message("runNoise", QString("set seed to %1").arg(seeds[i]));
-            parameter[NoiseTab]["seed"].value = seeds[i];
-            parameter[NoiseTab]["seed"].to_widget();
-
-            //create and write noise
-            createNoise();
-            plotData();
+            p.seed = seeds[i];
+            p.file = heka.sequence_to_template_file_name(sequence, path, i, 1);
+            ps["seed"].value = seeds[i];
+            if (!p.stream) p.key = noiseKey(ps);
+            batch.add(p);
+        }
 
-            QString filename = heka.sequence_to_template_file_name(sequence, path, i, 1);
-            saveData(filename);
+        bool suc = runBatch(batch);
+        if (!suc) {
+            error_message("runNoise", QString("could not write %1 of %2 noise templates").arg(batch.failed()).arg(nrep));
         }
+        checkSaturation("runNoise");
+        if (break_execution) {
+            updateHEKABatchId();
+            return;
+        }
+
+        //plot the last template only
+        parameter[NoiseTab]["seed"].value = seeds[nrep-1];
+        parameter[NoiseTab]["seed"].to_widget();
+        setData(batch.last());
+        plotData();
 
 
         runHEKA(sequence, comment, nrep * time, nrep * (time + 10), plot);
@@ -1822,6 +2628,7 @@ void MainWindow::runNoise() {
 
 void MainWindow::on_runAll_pushButton_clicked()
 {
+    if (batchRunning("runAll")) return;
     updateHEKA();
 
     break_execution = false;
@@ -2017,11 +2824,28 @@ void MainWindow::on_zap_lin_radioButton_clicked()
     update();
 }
 
+void MainWindow::on_noise_band_radioButton_clicked()
+{
+    update();
+}
+
+void MainWindow::on_noise_ou_radioButton_clicked()
+{
+    update();
+}
+
+void MainWindow::on_noise_lowpass_radioButton_clicked()
+{
+    update();
+}
+
 
 
 void MainWindow::on_noiselist_pushButton_clicked()
 {
-    // read list of nosie parameter and create tpl files
+    // read list of noise parameter and create tpl files:
+    // all lines are parsed first, the templates are then created and written in parallel
+    if (batchRunning("Noise list:")) return;
     QFile file(ui->noiselist_lineEdit->text());
     file.open(QIODevice::ReadOnly | QIODevice::Text);
     if (!file.isOpen()) {
@@ -2030,24 +2854,109 @@ void MainWindow::on_noiselist_pushButton_clicked()
         return;
     }
 
+    NoiseBatch batch(&heka, &cache);
+    connect(&batch, SIGNAL(progress(int,int,double,double)), this, SLOT(batchProgress(int,int,double,double)));
+
     QTextStream in(&file);
     while (!in.atEnd()) {
         QString comment = in.readLine();
-        bool ok = noise_parameter_from_comment(comment);
-        if (!ok) {
+        if (comment.trimmed().isEmpty()) continue;
+
+        // a copy, the noise tab keeps its parameter
+        ParameterSet ps(parameter[NoiseTab]);
+        NoiseParameter p;
+        if (!noise_parameter_from_comment(comment, ps) || !noise_parameter_to_struct(ps, p)) {
             error_message("Noise list:", QString("Cannot interpret noise parameter: %1").arg(comment));
-        } else {
-            message("Noise list:", QString("creating noise stimulus: %1").arg(comment));
-            createNoise();
+            continue;
+        }
+
+        p.file = QString("%1-%2.tpl").arg(ui->noiselist_filename_lineEdit->text()).arg(comment);
+        if (!p.stream) p.key = noiseKey(ps);
+        batch.add(p);
+    }
+    file.close();
 
-            QString outname(QString("%1-%2.tpl").arg(ui->noiselist_filename_lineEdit->text()).arg(comment));
-            message("Noise list:", QString("and saving to file: %1").arg(outname));
-            saveData(outname);
+    message("Noise list:", QString("creating %1 noise templates").arg(batch.size()));
+
+    updateTemplateFormat();
+    bool suc = runBatch(batch);
+    if (!suc) {
+        error_message("Noise list:", QString("could not write %1 of %2 noise templates").arg(batch.failed()).arg(batch.size()));
+    }
+    checkSaturation("Noise list:");
+    message("Noise list:", QString("%1 of %2 noise templates done").arg(batch.done()).arg(batch.size()));
+
+    if (batch.done() > 0) {
+        setData(batch.last());
+        plotData();
+    }
+}
+
+
+// runs a noise batch that can be stopped by the break buttons. The batch keeps processing events, runs started
+// meanwhile would reset break_execution and could write the same files, so they are refused until it is done
+bool MainWindow::runBatch(NoiseBatch& batch) {
+    batch_running = true;
+    break_execution = false;
+    bool suc = batch.run(&break_execution);
+    batch_running = false;
+    return suc;
+}
+
+bool MainWindow::batchRunning(const QString& routine) {
+    if (batch_running) error_message(routine, "a noise batch is running, wait until it is done or break it");
+    return batch_running;
+}
+
+
+// progress of a noise batch in the status bar
+void MainWindow::batchProgress(int done, int total, double rate, double sample_rate)
+{
+    ui->statusBar->showMessage(QString("%1 / %2 templates, %3 templates/s, %4 MSamples/s")
+                               .arg(done).arg(total).arg(rate, 0, 'f', 1).arg(sample_rate / 1e6, 0, 'f', 1), 2000);
+}
+
+
+void MainWindow::on_steps_pushButton_clicked()
+{
+    // read a step protocol, write it as template and / or as HEKA sequence
+    StepProtocol steps(ui->sample_SpinBox->value());
+    if (!steps.read(ui->steps_lineEdit->text().toStdString())) {
+        error_message("Steps:", QString("Cannot read step protocol: %1").arg(ui->steps_lineEdit->text()));
+        return;
+    }
+
+    plotSteps(steps);
+    message("Steps:", QString("%1 segments, %2 sec, %3 samples").arg(steps.segments().size())
+                                                               .arg(steps.duration()).arg(steps.length()));
+
+    QString outname = ui->steps_filename_lineEdit->text();
+    if (!outname.isEmpty()) {
+        message("Steps:", QString("saving to file: %1").arg(outname));
+        updateTemplateFormat();
+        if (!write_step_protocol(&heka, steps, outname)) {
+            error_message("Steps:", QString("could not write template %1").arg(outname));
         }
+        checkSaturation("Steps:");
+    }
 
+    QString sequence = ui->steps_sequence_lineEdit->text();
+    if (!sequence.isEmpty()) {
+        createStepSequence(sequence, steps);
     }
+}
 
-    file.close();
+
+void MainWindow::on_expression_pushButton_clicked()
+{
+    if (!createExpression()) return;
+    plotData();
+
+    QString outname = ui->expression_filename_lineEdit->text();
+    if (!outname.isEmpty()) {
+        message("Expression:", QString("saving to file: %1").arg(outname));
+        saveData(outname);
+    }
 }
 
 
@@ -24,6 +24,11 @@
 #include "numerics.h"
 
 #include "heka.h"
+#include "batch.h"
+#include "templatecache.h"
+#include "expression.h"
+#include "smoothing.h"
+#include "analysis.h"
 
 // basic class to store/handle all parameter information
 class Parameter {
@@ -74,6 +79,7 @@ public:
     void from_widgets();
 
     QString toString();
+    QString toKeyString();
 
     void write_settings(QSettings& settings);
     void read_settings(QSettings& settings);
@@ -85,6 +91,8 @@ public:
 
 
 
+class TemplateWorker;
+
 namespace Ui {
 class MainWindow;
 }
@@ -113,16 +121,36 @@ public:
     // Functionality
     bool createZap();
     bool createNoise();
+    bool createExpression();
+    bool createDataAsync();
+    void startWorker();
+    void finishData();
+    QString templateKey(int id, ParameterSet& p);
     bool createSin();
+    bool createBody(int id, ParameterSet& p, int npad, DataVECTOR& v, NoiseWorkspace* spectrum = 0,
+                    const CancelFlag* cancel = 0);
+    bool noiseShape(ParameterSet& p, NoiseShape& shape);
+    bool lookupData(const QString& key);
+    bool runBatch(NoiseBatch& batch);
+    bool batchRunning(const QString& routine);
+    DataVIEW dataView();
+    bool streamedNoise(ParameterSet& p);
+    QString noiseKey(ParameterSet& p);
+    void updateSinDuration();
     void createData();
     void plotData();
     void plotData(double dt);
+    void plotData(const DataVIEW& v, double dt);
+    void plotSteps(const StepProtocol& steps);
     void saveData();
     void saveData(const QString& file_name);
     void copyData(DataVECTOR& v);
     void setData(const DataVECTOR& v);
 
     void update();
+    bool updateFromBase();
+    double templateScale(int id, ParameterSet& p);
+    ParameterSet baseParameter(int id, const ParameterSet& p);
     void updateTemplateInfo();
 
     int index();
@@ -131,11 +159,16 @@ public:
     //HEKA scripts
     void updateHEKA();
     void updateHEKABatchId();
+    void updateTemplateFormat();
+    void checkSaturation(const QString& routine);
 
     bool zap_parameter_from_comment(const QString& comment);
     void zap_parameter_to_comment(QString& comment);
     bool noise_parameter_from_comment(const QString& comment);
+    bool noise_parameter_from_comment(const QString& comment, ParameterSet& ps);
     void noise_parameter_to_comment(QString& comment);
+    bool noise_parameter_to_struct(NoiseParameter& p);
+    bool noise_parameter_to_struct(ParameterSet& ps, NoiseParameter& p);
     bool sin_parameter_from_comment(const QString& comment);
     void sin_parameter_to_comment(QString& comment);
 
@@ -146,6 +179,7 @@ public:
     void readManualBatchFile();
 
     bool createTemplateSequence(const QString& name, double dur, int nsweep =1);
+    bool createStepSequence(const QString& name, const StepProtocol& steps, int nsweep =1);
     bool runHEKA(const QString& sequence, const QString& comment, double off, double dur, bool plot, int nrep = 1);
     void breakHEKA();
     void runRun();
@@ -153,6 +187,9 @@ public:
     void runNoise();
     void runSin();
     void runResonance();
+    void smoothResonance(bool report);
+    void analyzeSweep(bool plot);
+    void sweepStatistic(const SweepStatistics& stats, DataVECTOR& v);
 
 
 
@@ -176,6 +213,9 @@ private slots:
     void on_f1_SpinBox_editingFinished();
     void on_amp_SpinBox_editingFinished();
     void on_reverseCheckBox_clicked();
+    void on_preciseCheckBox_clicked();
+
+    void on_multirateCheckBox_clicked();
 
     void on_createButton_2_clicked();
     void on_omega_SpinBox_2_editingFinished();
@@ -184,6 +224,11 @@ private slots:
     void on_f0_SpinBox_2_editingFinished();
     void on_f1_SpinBox_2_editingFinished();
     void on_sigma_SpinBox_2_editingFinished();
+    void on_alpha_SpinBox_2_editingFinished();
+    void on_psd_lineEdit_2_editingFinished();
+    void on_stream_checkBox_2_clicked();
+
+    void on_tau_SpinBox_2_editingFinished();
     void on_seed_SpinBox_2_editingFinished();
 
     void on_tabWidget_currentChanged(int index);
@@ -208,6 +253,16 @@ private slots:
 
     void on_runResonance_pushButton_clicked();
 
+    void on_resonanceSmooth_spinBox_valueChanged(int);
+
+    void on_resonanceBoxcar_radioButton_clicked();
+
+    void on_resonanceAverage_radioButton_clicked();
+
+    void on_resonanceGaussian_radioButton_clicked();
+
+    void on_resonanceGolay_radioButton_clicked();
+
     void on_runAll_pushButton_clicked();
 
     void on_runSin_pushButton_clicked();
@@ -250,12 +305,26 @@ private slots:
 
     void on_noiselist_pushButton_clicked();
 
+    void batchProgress(int done, int total, double rate, double sample_rate);
+
+    void templateFinished();
+
+    void on_steps_pushButton_clicked();
+
+    void on_expression_pushButton_clicked();
+
     void on_zap_sqr_radioButton_clicked();
 
     void on_zap_exp_radioButton_clicked();
 
     void on_zap_lin_radioButton_clicked();
 
+    void on_noise_band_radioButton_clicked();
+
+    void on_noise_ou_radioButton_clicked();
+
+    void on_noise_lowpass_radioButton_clicked();
+
 private:
     Ui::MainWindow *ui;
     QCustomPlot * graphWidget;
@@ -267,6 +336,30 @@ public:
     Heka::TemplateVECTOR data;
     QVector<double> x,y;
 
+    //incremental updates: unscaled template body and how data was derived from it
+    DataVECTOR base;
+    ParameterSet base_parameter;
+    bool data_from_base;
+    DataTYPE data_scale, data_off;
+    int data_nl;
+
+    //background creation of large templates, see createDataAsync
+    friend class TemplateWorker;
+    TemplateWorker* worker;
+    bool worker_restart;
+    int generation;          // increased whenever data is replaced, results of older workers are dropped
+    int pending_id, pending_generation;
+    ParameterSet pending_parameter;
+    QString pending_key;
+
+    //streamed noise: data holds only the start of the template of stream_parameter if stream_generation is current
+    int stream_generation;
+    ParameterSet stream_parameter;
+
+    //cache key of data if key_generation is current, the template is added to the cache when it is saved
+    QString data_key;
+    int key_generation;
+
     //parameter handling
     enum CreatorTabs {ZapTab = 0, NoiseTab, SinTab, NCreatorTabs};
     std::vector<ParameterSet> parameter;
@@ -280,7 +373,28 @@ public:
     //Heka communication
     Heka heka;
 
+    //stages and buffers of runResonance, kept between scans together with the last impedance and fit
+    ResonancePipeline resonance;
+
+    //spike triggered average updated by runHEKA after each sweep while set
+    SpikeTriggeredAverage* sta;
+    DataTYPE sta_threshold;
+    int sta_refractory;
+    double sta_dt;
+
+    //per sample statistics of the sweeps of runRun while set
+    SweepStatistics* sweep_stats;
+
+    //created templates
+    TemplateCache cache;
+
+    //template found in the cache: if cached_generation is current, data is the mapped template cached and empty,
+    //declared after cache, which it has to be destroyed before
+    CachedTemplate cached;
+    int cached_generation;
+
     bool break_execution;
+    bool batch_running;      // a NoiseBatch is running, see runBatch
 };
 
 #endif // MAINWINDOW_H
@@ -17,7 +17,13 @@
 #include <vector>
 #include <algorithm>
 #include <fstream>
+#include <sstream>
+
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
 #include <math.h>
+#include <float.h>
 
 const double pi = 4*atan(1);
 
@@ -35,186 +41,415 @@ const double pi = 4*atan(1);
 void postprocess_template(DataTYPE samp, DataTYPE off, DataTYPE left, DataTYPE right,
                                       DataVECTOR& v) {
 
-    DataTYPE dt = 1.0 /samp / 1000.0;
+    int nl, nr;
+    template_margins(samp, left, right, nl, nr);
+    int nb = v.size();
 
-    // add offsets
-    for (int i =0; i < v.size(); i++) {
+    // move body in place to its final position, margins are filled afterwards
+    v.resize(nl + nb + nr);
+    DataTYPE * b = nb > 0 ? &v[0] : 0;
+    if (nl > 0) std::copy_backward(b, b + nb, b + nl + nb);
+
+    std::fill(v.begin(), v.begin() + nl, off);
+    for (int i = nl; i < nl + nb; i++) {
         v[i] += off;
     }
+    std::fill(v.begin() + nl + nb, v.end(), off);
+}
 
-    //add left and right margins
-    if (left<= 0.0 && right <= 0.0) return;
 
-    //resize:
-    int nl = int(left / dt);
-    int nr = int(right / dt);
-    int n = v.size() + nl + nr;
+//size v for the final template and fill the margins, the body is written by the generators
+DataTYPE* prepare_template(DataTYPE samp, DataTYPE off, DataTYPE left, DataTYPE right, int nbody, int npad,
+                           DataVECTOR& v) {
+    int nl, nr;
+    template_margins(samp, left, right, nl, nr);
+    nr += npad;
+    if (nbody < 0) nbody = 0;
 
-    DataTYPE * vnew = new DataTYPE[n];
-    for (int i = 0; i < nl; i++) { vnew[i] = off; }
-    copy ( v.begin(), v.end(), vnew + nl);
-    for (int i = v.size()+nl; i < n; i++) { vnew[i] = off; }
+    v.resize(nl + nbody + nr);
+    std::fill(v.begin(), v.begin() + nl, off);
+    std::fill(v.begin() + nl + nbody, v.end(), off);
 
-    v.resize(n);
-    copy(vnew, vnew+n, v.begin());
+    if (v.empty()) return 0;
+    return &v[0] + nl;
+}
 
-    delete [] vnew;
+
+int template_length(DataTYPE dur, DataTYPE samp) {
+    return int(dur * samp * 1000) + 1;
 }
 
 
+//margins in samples as used by postprocess_template
+void template_margins(DataTYPE samp, DataTYPE left, DataTYPE right, int& nl, int& nr) {
+    DataTYPE dt = 1.0 /samp / 1000.0;
+    nl = 0; nr = 0;
+    if (left > 0.0) nl = int(left / dt);
+    if (right > 0.0) nr = int(right / dt);
+}
 
 
-/* create a zap stimulus of duration dur [sec], starting from freq f0 to f1 [Hz] with amplitude amp, and constant offset off, add constant stimulation of length left and right
- * assume sampling frequency of samp [kHz]
- */
-bool create_zap(DataTYPE dur, DataTYPE samp,
-                            DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse,
-                            DataVECTOR& v ) {
+//fused scaling, offset and margins
+void scale_offset_template(const DataVECTOR& base, DataTYPE scale, DataTYPE off, int nl, int nr,
+                           DataVECTOR& v) {
+    int nb = base.size();
+    int n = nl + nb + nr;
+    v.resize(n);
+    if (n == 0) return;
 
-   /* zap stim is given by  sin(t ((f1-f0) t/dur + f0)) */
-   /* here time is measured in secs */
+    DataTYPE * out = &v[0];
+    const DataTYPE * in = nb > 0 ? &base[0] : 0;
 
-   /* for sampling rate of samp kHz we have a dt = 1/samp / 1000 */
+    for (int i = 0; i < nl; i++) out[i] = off;
+    out += nl;
+    for (int i = 0; i < nb; i++) out[i] = scale * in[i] + off;
+    out += nb;
+    for (int i = 0; i < nr; i++) out[i] = off;
+}
 
 
-   DataTYPE dt = 1.0 / samp / 1000.0;
-   int n = int(dur * samp * 1000) + 1;
+int convert_to_int16(const DataTYPE* x, int n, double scale, short* y) {
+    // branch free so that the loop vectorizes
+    int nsat = 0;
+    for (int i = 0; i < n; i++) {
+        double v = scale * x[i];
+        nsat += (v > 32767.0) | (v < -32768.0);
+        v = std::min(std::max(v, -32768.0), 32767.0);
+        // shifted to positive values truncation rounds to nearest
+        y[i] = short(int(v + 32768.5) - 32768);
+    }
+    return nsat;
+}
 
 
-   DataTYPE ph0 = 0;
-   if (reverse) {
-      //ph0 = 2 * pi * (dur) * ((f1-f0) / 2.0 + f0);
-      ph0 = -dur * pi * (f0 + f1); // this adjust phase to get zero at end of zap !
-   }
 
-   v.resize(n);
-   DataTYPE t = 0;
-   for (int i = 0; i < n; i++) {
-       if (reverse)
-           //v[i] = amp * sin(2 * pi * (dur - t) * ((f1-f0) * (dur -t) / dur / 2.0 + f0) + ph0); //old
-           v[i] = amp * sin(2 * pi * t / (2 * dur) * (t * f0 +(2 * dur - t)* f1) + ph0 + pi);
-       else
-           v[i] = amp * sin(2 * pi * t * ((f1-f0) * (t / dur)/2.0 + f0));
-       t+=dt;
-   }
 
-   return true;
-}
+/* zap stim is given by  sin(t ((f1-f0) t/dur + f0)) */
+/* here time is measured in secs */
 
+/* for sampling rate of samp kHz we have a dt = 1/samp / 1000 */
 
 
-/* create a zap stimulus of duration dur [sec], starting from freq f0 to f1 [Hz] increasing with t^2 with amplitude amp, and constant offset off, add constant stimulation of length left and right
- * assume sampling frequency of samp [kHz]
+/* phase of the zaps (argument of the sine) at time t for type 0 (linear), 1 (t^2) and 2 (exponential)
+ * T is the type of the time and parameters, P the type of the constants pi and e:
+ * <DataTYPE, double> is the original float version, <double, double> the precise one
+ * ph0 = zap_phase0 adjusts the phase to get zero at end of a reversed zap
  */
-bool create_zap_2(DataTYPE dur, DataTYPE samp,
-                            DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse,
-                            DataVECTOR& v ) {
+template <class T, class P>
+static T zap_phase0(int type, T dur, T f0, T f1, bool reverse, P pi_, P e) {
+    if (!reverse) return 0;
+
+    if (type == 0) {
+        //ph0 = 2 * pi * (dur) * ((f1-f0) / 2.0 + f0);
+        return -dur * pi_ * (f0 + f1);
+    } else if (type == 1) {
+        return -2 * pi_ /3 * dur * (2 * f0 + f1);
+    } else {
+        return -2 * pi_ /(e-1) * dur * (f0 + (e-2) * f1);
+    }
+}
 
-   /* zap stim is given by  sin(t ((f1-f0) t/dur + f0)) */
-   /* here time is measured in secs */
+template <class T, class P>
+static P zap_phase(int type, T t, T dur, T f0, T f1, bool reverse, T ph0, P pi_, P e) {
+    if (type == 0) {
+        if (reverse)
+            //v[i] = amp * sin(2 * pi * (dur - t) * ((f1-f0) * (dur -t) / dur / 2.0 + f0) + ph0); //old
+            return 2 * pi_ * t / (2 * dur) * (t * f0 +(2 * dur - t)* f1) + ph0 + pi_;
+        else
+            return 2 * pi_ * t * ((f1-f0) * (t / dur)/2.0 + f0);
+
+    } else if (type == 1) {
+        if (reverse)
+            return 2 * pi_ * t /(3 * dur * dur) * ((3 * dur - t) * t * f0  + (3 * dur * dur - 3 * dur * t + t*t) * f1)+ ph0 + pi_;
+        else
+            return 2 * pi_ * ((f1-f0) * pow(t,3) / (3 * dur * dur) + t * f0 );
+
+    } else {
+        if (reverse)
+            return 2 * pi_ * (t*f0 + (dur * e * (1-exp(-t/dur))-t)*(f1-f0)/(e -1))+ph0 + pi_;
+        else
+            return 2 * pi_ * ((dur * (exp(t/dur)-1)-t)*(f1-f0) / (e-1) + t * f0);
+    }
+}
 
-   /* for sampling rate of samp kHz we have a dt = 1/samp / 1000 */
 
+// block size of the precise zap: phases of a block are computed first, then their sines in one float loop;
+// all zaps check for cancellation once per block
+static const int zap_block = 1024;
 
-   DataTYPE dt = 1.0 / samp / 1000.0;
-   int n = int(dur * samp * 1000) + 1;
+static inline bool cancelled(const CancelFlag* cancel) {
+    return cancel && *cancel;
+}
 
-   DataTYPE ph0 = 0;
-   if (reverse) {
-      ph0 = -2 * pi /3 * dur * (2 * f0 + f1);
-   }
+// zap of given type: float mode accumulates t in DataTYPE, precise mode uses t = i dt and the phase in double,
+// reduced to [-pi, pi] before it is rounded to float
+static void zap(int type, DataTYPE dur, DataTYPE samp,
+                DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse, bool precise,
+                DataTYPE off, DataTYPE* v, const CancelFlag* cancel = 0) {
+
+    int n = template_length(dur, samp);
+    double e = exp(1);
+    DataTYPE x;
+
+    if (precise) {
+        double dt = 1.0 / double(samp) / 1000.0;
+        double ph0 = zap_phase0<double, double>(type, dur, f0, f1, reverse, pi, e);
+
+        float ph[zap_block];
+        for (int b = 0; b < n; b += zap_block) {
+            if (cancelled(cancel)) return;
+            int nb = std::min(zap_block, n - b);
+            for (int i = 0; i < nb; i++) {
+                double p = zap_phase<double, double>(type, (b + i) * dt, dur, f0, f1, reverse, ph0, pi, e);
+                ph[i] = p - 2 * pi * floor(p / (2 * pi) + 0.5);
+            }
 
-   v.resize(n);
-   DataTYPE t = 0;
-   for (int i = 0; i < n; i++) {
-       if (reverse)
-           v[i] = amp * sin(2 * pi * t /(3 * dur * dur) * ((3 * dur - t) * t * f0  + (3 * dur * dur - 3 * dur * t + t*t) * f1)+ ph0 + pi);
-       else
-           v[i] = amp * sin(2 * pi * ((f1-f0) * pow(t,3) / (3 * dur * dur) + t * f0 ));
-       t+=dt;
-   }
+            DataTYPE * vb = v + b;
+            for (int i = 0; i < nb; i++) {
+                x = amp * sinf(ph[i]);
+                vb[i] = x + off;
+            }
+        }
 
-   return true;
+    } else {
+        DataTYPE dt = 1.0 / samp / 1000.0;
+        DataTYPE ph0 = zap_phase0<DataTYPE, double>(type, dur, f0, f1, reverse, pi, e);
+
+        DataTYPE t = 0;
+        for (int b = 0; b < n; b += zap_block) {
+            if (cancelled(cancel)) return;
+            int nb = std::min(zap_block, n - b);
+            DataTYPE * vb = v + b;
+            for (int i = 0; i < nb; i++) {
+                x = amp * sin(zap_phase<DataTYPE, double>(type, t, dur, f0, f1, reverse, ph0, pi, e));
+                vb[i] = x + off;
+                t+=dt;
+            }
+        }
+    }
 }
 
 
-
-/* create a zap stimulus of duration dur [sec], starting from freq f0 to f1 [Hz] increasing exponentially, with amplitude amp, and constant offset off, add constant stimulation of length left and right
+/* create a zap stimulus of duration dur [sec], starting from freq f0 to f1 [Hz] with amplitude amp, and constant offset off, add constant stimulation of length left and right
  * assume sampling frequency of samp [kHz]
  */
-bool create_zap_exp(DataTYPE dur, DataTYPE samp,
+void create_zap(DataTYPE dur, DataTYPE samp,
                             DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse,
-                            DataVECTOR& v ) {
+                            DataTYPE off, DataTYPE* v, bool precise, const CancelFlag* cancel ) {
+   zap(0, dur, samp, f0, f1, amp, reverse, precise, off, v, cancel);
+}
 
-   /* zap stim is given by  sin(t ((f1-f0) t/dur + f0)) */
-   /* here time is measured in secs */
+bool create_zap(DataTYPE dur, DataTYPE samp,
+                            DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse,
+                            DataVECTOR& v, bool precise ) {
+   v.resize(template_length(dur, samp));
+   zap(0, dur, samp, f0, f1, amp, reverse, precise, 0, &v[0]);
+   return true;
+}
 
-   /* for sampling rate of samp kHz we have a dt = 1/samp / 1000 */
 
 
-   DataTYPE dt = 1.0 / samp / 1000.0;
-   int n = int(dur * samp * 1000) + 1;
+/* create a zap stimulus of duration dur [sec], starting from freq f0 to f1 [Hz] increasing with t^2 with amplitude amp, and constant offset off, add constant stimulation of length left and right
+ * assume sampling frequency of samp [kHz]
+ */
+void create_zap_2(DataTYPE dur, DataTYPE samp,
+                            DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse,
+                            DataTYPE off, DataTYPE* v, bool precise, const CancelFlag* cancel ) {
+   zap(1, dur, samp, f0, f1, amp, reverse, precise, off, v, cancel);
+}
 
-   DataTYPE ph0 = 0;
-   if (reverse) {
-       ph0 = -2 * pi /(exp(1)-1) * dur * (f0 + (exp(1)-2) * f1);
-   }
+bool create_zap_2(DataTYPE dur, DataTYPE samp,
+                            DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse,
+                            DataVECTOR& v, bool precise ) {
+   v.resize(template_length(dur, samp));
+   zap(1, dur, samp, f0, f1, amp, reverse, precise, 0, &v[0]);
+   return true;
+}
 
 
-   v.resize(n);
-   DataTYPE t = 0;
-   for (int i = 0; i < n; i++) {
-       if (reverse)
-           v[i] = amp * sin(2 * pi * (t*f0 + (dur * exp(1) * (1-exp(-t/dur))-t)*(f1-f0)/(exp(1) -1))+ph0 + pi);
-       else
-           v[i] = amp * sin(2 * pi * ((dur * (exp(t/dur)-1)-t)*(f1-f0) / (exp(1)-1) + t * f0));
-       t+=dt;
-   }
 
+/* create a zap stimulus of duration dur [sec], starting from freq f0 to f1 [Hz] increasing exponentially, with amplitude amp, and constant offset off, add constant stimulation of length left and right
+ * assume sampling frequency of samp [kHz]
+ */
+void create_zap_exp(DataTYPE dur, DataTYPE samp,
+                            DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse,
+                            DataTYPE off, DataTYPE* v, bool precise, const CancelFlag* cancel ) {
+   zap(2, dur, samp, f0, f1, amp, reverse, precise, off, v, cancel);
+}
+
+bool create_zap_exp(DataTYPE dur, DataTYPE samp,
+                            DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse,
+                            DataVECTOR& v, bool precise ) {
+   v.resize(template_length(dur, samp));
+   zap(2, dur, samp, f0, f1, amp, reverse, precise, 0, &v[0]);
    return true;
 }
 
 
+// phase error of the zap generators against a long double reference with exact t = i dt: a bound for the precise
+// mode, an estimate from nprobe samples for the float mode
+double zap_phase_error(int type, DataTYPE dur, DataTYPE samp, DataTYPE f0, DataTYPE f1, bool reverse,
+                       bool precise, int nprobe) {
+
+    int n = template_length(dur, samp);
+    if (n < 1) return 0;
+    if (nprobe < 1) nprobe = 1;
+    int step = n / nprobe;
+    if (step < 1) step = 1;
+
+    double e = exp(1);
+    long double lpi = 4 * atan(1.0L);
+    long double le = exp(1.0L);
+    long double ldt = 1.0L / (long double) samp / 1000.0L;
+    long double lph0 = zap_phase0<long double, long double>(type, dur, f0, f1, reverse, lpi, le);
+
+    double err = 0, phmax = 0;
+    long double ref;
+
+    if (precise) {
+        double dt = 1.0 / double(samp) / 1000.0;
+        double ph0 = zap_phase0<double, double>(type, dur, f0, f1, reverse, pi, e);
+
+        for (int i = 0; i < n; i += step) {
+            int k = (i + step >= n) ? n-1 : i; // always probe the last sample
+            ref = zap_phase<long double, long double>(type, k * ldt, dur, f0, f1, reverse, lph0, lpi, le);
+            double ph = zap_phase<double, double>(type, k * dt, dur, f0, f1, reverse, ph0, pi, e);
+            err = std::max(err, double(fabs(ph - ref)));
+            phmax = std::max(phmax, double(fabs(ref)));
+        }
 
+        // long double may be double (e.g. MSVC): never report less than the rounding bound of the phase,
+        // plus the rounding of the reduced phase to float
+        phmax = std::max(phmax, fabs(ph0) + pi);
+        err = std::max(err, 16 * DBL_EPSILON * phmax) + pi * FLT_EPSILON / 2;
+
+    } else {
+        // the float time has to be accumulated as in the generator
+        DataTYPE dt = 1.0 / samp / 1000.0;
+        DataTYPE ph0 = zap_phase0<DataTYPE, double>(type, dur, f0, f1, reverse, pi, e);
+
+        DataTYPE t = 0;
+        for (int i = 0; i < n; i++) {
+            if (i % step == 0 || i == n-1) {
+                ref = zap_phase<long double, long double>(type, i * ldt, dur, f0, f1, reverse, lph0, lpi, le);
+                double ph = zap_phase<DataTYPE, double>(type, t, dur, f0, f1, reverse, ph0, pi, e);
+                err = std::max(err, double(fabs(ph - ref)));
+            }
+            t+=dt;
+        }
+    }
 
+    return err;
+}
 
 
 
 
-/* create a noise stimulus of duration dur [sec] with uniform frequency spectrum from f0 to f1 [Hz] with standard deviation sigma add constant stimulation offset off
- * add LFP like signal underneath with amplitude amp / phase and freqeuncy omega [Hz]
- * assume sampling frequency of samp [kHz]
- */
-bool create_noise(DataTYPE dur, DataTYPE samp,
-                              DataTYPE ff,  DataTYPE phase, DataTYPE amp,
-                              DataTYPE f0, DataTYPE f1, DataTYPE sigma, int seed,
-                              DataVECTOR& v) {
-    DEBUG("create_noise")
 
-    //working own fft.h version with optimized sample size
 
-    srand(seed);
 
+
+// noise workspace: fft plan and buffers for the optimized fft size
+int noise_length(DataTYPE dur, DataTYPE samp) {
     DataTYPE dt = 1.0 /samp / 1000.0;
     int n_final = floor(dur/dt);
     DEBUG(QString("fft dt= %1  n_final =%2, dur= %3").arg(dt).arg(n_final).arg(dur).toStdString())
 
     if (n_final<1) n_final=1;
     if (n_final % 2 != 0) n_final--;
+    return n_final;
+}
+
+void NoiseWorkspace::setup(DataTYPE dur, DataTYPE samp) {
+    n_final = noise_length(dur, samp);
 
     //find next larger optimal n;
     int n = find_good_larger_fft_size(n_final);
 
     DEBUG(QString("n_final=%1 fft_size=%2").arg(n_final).arg(n).toStdString())
 
+    plan.setup(n);
+    fft_r.resize(n);
+    fft_i.resize(n);
+    fft_out_r.resize(n);
+    fft_out_i.resize(n);
+}
+
+
+// noise shapes
+NoiseShape::NoiseShape() : alpha(0) {}
+
+bool NoiseShape::flat() const {
+    return alpha == 0 && psd.empty();
+}
+
+bool NoiseShape::read_psd(const std::string& file_name) {
+    std::ifstream file(file_name.c_str());
+    if (!file.is_open()) return false;
+
+    psd_f.clear();
+    psd.clear();
+
+    double f, p;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream str(line);
+        if (!(str >> f >> p)) return false;
+        if (!psd_f.empty() && f <= psd_f.back()) return false;
+        if (p < 0) return false;
+        psd_f.push_back(f);
+        psd.push_back(p);
+    }
+
+    return !psd.empty();
+}
+
+// magnitudes m[i] of the bins at i * df, i < nbins
+void NoiseShape::magnitudes(double df, int nbins, double* m) const {
+    if (nbins <= 0) return;
+    m[0] = 0;
+
+    if (!psd.empty()) {
+        // tabulated power: linear interpolation, bins and table are both sorted -> single sweep
+        int k = 0, nt = psd.size();
+        for (int i = 1; i < nbins; i++) {
+            double f = i * df;
+            while (k < nt && psd_f[k] < f) k++;
+
+            double p;
+            if (k == 0) p = psd[0];
+            else if (k == nt) p = psd[nt-1];
+            else p = psd[k-1] + (psd[k] - psd[k-1]) * (f - psd_f[k-1]) / (psd_f[k] - psd_f[k-1]);
+
+            m[i] = sqrt(p);
+        }
+
+    } else if (alpha == 0) {
+        for (int i = 1; i < nbins; i++) m[i] = 1.0;
+
+    } else {
+        // power ~ 1/f^alpha -> magnitude (f/df)^(-alpha/2), the overall scale is removed by the normalization
+        double a = -0.5 * alpha;
+        for (int i = 1; i < nbins; i++) m[i] = exp(a * log(double(i)));
+    }
+}
+
+
+// draw random phases for the noise spectrum -> uses rand(), so not thread safe
+void create_noise_spectrum(DataTYPE dur, DataTYPE f0, DataTYPE f1, int seed,
+                           NoiseWorkspace& w, const NoiseShape* shape) {
+    DEBUG("create_noise_spectrum")
+
+    srand(seed);
+
+    int n = w.plan.size();
     int n2 = n/2;
 
     DEBUG(QString("fft n=%1, n2=n/2=%2").arg(n).arg(n2).toStdString())
 
-    double * fft_r = new double[n];
-    double * fft_i = new double[n];
-    double * fft_out_r = new double[n];
-    double * fft_out_i = new double[n];
+    double * fft_r = &w.fft_r[0];
+    double * fft_i = &w.fft_i[0];
     double rphase;
 
     fft_r[0] = 0.0;
@@ -238,42 +473,496 @@ bool create_noise(DataTYPE dur, DataTYPE samp,
         fft_i[n-i] = - fft_i[i];
     }
 
+    // shape the magnitudes, the phases stay the ones of the flat spectrum of the same seed
+    if (shape && !shape->flat() && n2 > 1) {
+        w.mag.resize(n2);
+        shape->magnitudes(1.0/dur, n2, &w.mag[0]);
+        const double * m = &w.mag[0];
+
+        for (int i= 1; i < n2; i++) {
+            fft_r[i] *= m[i];
+            fft_i[i] *= m[i];
+            fft_r[n-i] = fft_r[i];
+            fft_i[n-i] = - fft_i[i];
+        }
+    }
+
     DEBUG("fft filled!")
+}
 
-    fft(n, fft_r, fft_i, fft_out_r, fft_out_i);
+
+// block size of the noise normalization, small enough for a block to stay in the cache
+static const int noise_block = 1024;
+
+// transform the spectrum in w, normalize and add the LFP sine and offset -> thread safe given an own workspace
+void synthesize_noise(DataTYPE samp,
+                      DataTYPE ff,  DataTYPE phase, DataTYPE amp, DataTYPE sigma,
+                      DataTYPE off, NoiseWorkspace& w, DataTYPE* v, const CancelFlag* cancel) {
+    DEBUG("synthesize_noise")
+
+    DataTYPE dt = 1.0 /samp / 1000.0;
+    int n_final = w.n_final;
+
+    w.plan.execute(&w.fft_r[0], &w.fft_i[0], &w.fft_out_r[0], &w.fft_out_i[0]);
 
     DEBUG("fft done!")
 
-    v.resize(n_final);
-    for (int i= 0; i < n_final; i++) {
-        v[i]= fft_out_r[i];
-    }
+    const double * fft_out_r = &w.fft_out_r[0];
 
-    //normalize standard deviation to sigma
-    double var = 0;
+    //first pass: convert and get mean and variance block wise, blocks are combined as in Welford's / Chan's update
     double mean = 0;
-    for (int i= 0; i < n_final; i++) {
-        var += v[i]*v[i];
-        mean += v[i];
-    }
+    double m2 = 0;
+    int n = 0;
+    for (int b = 0; b < n_final; b += noise_block) {
+        if (cancelled(cancel)) return;
+        int nb = std::min(noise_block, n_final - b);
+        DataTYPE * vb = v + b;
+
+        double sum = 0;
+        for (int i = 0; i < nb; i++) {
+            vb[i] = fft_out_r[b + i];
+            sum += vb[i];
+        }
+        double mb = sum / nb;
 
-    var = var/n_final;
-    mean= mean/n_final; //mean should be zero by construction
-    var = var - mean*mean;
+        double m2b = 0;
+        for (int i = 0; i < nb; i++) {
+            double d = vb[i] - mb;
+            m2b += d * d;
+        }
+
+        double delta = mb - mean;
+        int nn = n + nb;
+        mean += delta * nb / nn;
+        m2 += m2b + delta * delta * double(n) * nb / nn;
+        n = nn;
+    }
 
+    //normalize standard deviation to sigma, mean should be zero by construction
+    double var = n_final > 0 ? m2 / n_final : 0;
     double fac = sigma/sqrt(var);
 
-    // add sine wave
-    for (int i = 0; i < n_final; i++) {
-        v[i] = fac*(v[i]-mean) + amp * sin(2*3.141592653589793*ff*i*dt+phase);
+    //second pass: scale, add sine wave and offset
+    //the sine is rotated from sample to sample and set exactly at the start of each block
+    double omega = 2*3.141592653589793*ff*dt;
+    double co = cos(omega), so = sin(omega);
+    DataTYPE x;
+    for (int b = 0; b < n_final; b += noise_block) {
+        if (cancelled(cancel)) return;
+        int nb = std::min(noise_block, n_final - b);
+        DataTYPE * vb = v + b;
+
+        if (amp == 0) {
+            for (int i = 0; i < nb; i++) {
+                x = fac*(vb[i]-mean);
+                vb[i] = x + off;
+            }
+        } else {
+            double ph = 2*3.141592653589793*ff*b*dt+phase;
+            double s = sin(ph), c = cos(ph), sn;
+            for (int i = 0; i < nb; i++) {
+                x = fac*(vb[i]-mean) + amp * s;
+                vb[i] = x + off;
+                sn = s * co + c * so;
+                c = c * co - s * so;
+                s = sn;
+            }
+        }
     }
+}
 
-    delete [] fft_r;
-    delete [] fft_i;
-    delete [] fft_out_r;
-    delete [] fft_out_i;
+bool synthesize_noise(DataTYPE samp,
+                      DataTYPE ff,  DataTYPE phase, DataTYPE amp, DataTYPE sigma,
+                      NoiseWorkspace& w, DataVECTOR& v) {
+    v.resize(w.n_final);
+    synthesize_noise(samp, ff, phase, amp, sigma, 0, w, v.empty() ? 0 : &v[0]);
+    return true;
+}
+
+
+// streaming noise by overlap-add of windowed blocks
+NoiseStream::NoiseStream(DataTYPE samp,
+                         DataTYPE ff,  DataTYPE phase, DataTYPE amp,
+                         DataTYPE f0, DataTYPE f1, DataTYPE sigma, int seed,
+                         DataTYPE off, const NoiseShape* sh, int block)
+    : ff(ff), phase(phase), amp(amp), f0(f0), f1(f1), sigma(sigma), off(off), count(0) {
+
+    dt = 1.0 /samp / 1000.0;
+
+    // default: blocks of at least 10 sec -> frequency resolution of 0.1 Hz
+    if (block <= 0) block = std::max(16384, int(10.0 / dt));
+    int n = find_good_larger_fft_size(block);
+    while (n % 2 != 0) n = find_good_larger_fft_size(n+1);
+    nblock = n;
+    nhop = n/2;
+
+    plan.setup(n);
+    re.resize(n); im.resize(n);
+    out_r.resize(n); out_i.resize(n);
+    acc.assign(n, 0.0);
+
+    // sine window: squares of windows overlapping by half a block add up to one
+    window.resize(n);
+    for (int i = 0; i < n; i++) window[i] = sin(3.141592653589793 * (i + 0.5) / n);
+
+    if (sh) shape = *sh;
+    mag.resize(n/2);
+    if (shape.flat()) {
+        for (int i = 0; i < n/2; i++) mag[i] = 1.0;
+    } else {
+        shape.magnitudes(1.0/(n*dt), n/2, &mag[0]);
+    }
+
+    state = (unsigned int)(seed) * 2654435761u ^ 0x9e3779b9u;
+    if (state == 0) state = 1;
+
+    // fill the first half block so that the stream starts in the steady state
+    next_block();
+    shift();
+    next_block();
+    pos = 0;
+}
+
+// uniform random number in [0,1), xorshift generator
+double NoiseStream::random() {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state / 4294967296.0;
+}
+
+void NoiseStream::shift() {
+    std::copy(acc.begin() + nhop, acc.end(), acc.begin());
+    std::fill(acc.begin() + nblock - nhop, acc.end(), 0.0);
+}
+
+// random phase block, scaled to sigma analytically: for a full period the mean square is the spectral power
+void NoiseStream::next_block() {
+    int n = nblock;
+    int n2 = n/2;
+    double df = 1.0 / (n * dt);
+
+    re[0] = 0; im[0] = 0;
+    re[n2] = 0; im[n2] = 0;
+
+    double power = 0;
+    for (int i = 1; i < n2; i++) {
+        double f = i * df;
+        if (f0 <= f && f <= f1 && mag[i] > 0) {
+            double rphase = random() * 2*3.141592653589793;
+            re[i] = mag[i] * cos(rphase);
+            im[i] = mag[i] * sin(rphase);
+            power += 2 * mag[i] * mag[i];
+        } else {
+            re[i] = 0;
+            im[i] = 0;
+        }
+        re[n-i] = re[i];
+        im[n-i] = - im[i];
+    }
+
+    plan.execute(&re[0], &im[0], &out_r[0], &out_i[0]);
+
+    double fac = power > 0 ? sigma / sqrt(power) : 0;
+    for (int i = 0; i < n; i++) acc[i] += fac * window[i] * out_r[i];
+}
+
+void NoiseStream::read(DataTYPE* v, int n) {
+    DataTYPE x;
+    while (n > 0) {
+        if (pos == nhop) {
+            shift();
+            next_block();
+            pos = 0;
+        }
+
+        int k = std::min(n, nhop - pos);
+        const double * a = &acc[pos];
+
+        if (amp == 0) {
+            for (int i = 0; i < k; i++) {
+                x = a[i];
+                v[i] = x + off;
+            }
+        } else {
+            // sine by rotation, set exactly at the start of each chunk
+            double omega = 2*3.141592653589793*ff*dt;
+            double co = cos(omega), so = sin(omega);
+            double ph = 2*3.141592653589793*ff*count*dt+phase;
+            double s = sin(ph), c = cos(ph), sn;
+            for (int i = 0; i < k; i++) {
+                x = a[i] + amp * s;
+                v[i] = x + off;
+                sn = s * co + c * so;
+                c = c * co - s * so;
+                s = sn;
+            }
+        }
+
+        v += k;
+        n -= k;
+        pos += k;
+        count += k;
+    }
+}
+
+
+// block parallel execution: block b of nblocks is run by thread b % nthreads
+class BlockRunnable : public QRunnable {
+public:
+    BlockRunnable(BlockTask* t, int first, int step, int n) : task(t), first(first), step(step), n(n) {}
+    void run() {
+        for (int b = first; b < n; b += step) task->block(b);
+    }
+private:
+    BlockTask* task;
+    int first, step, n;
+};
+
+void run_blocks(BlockTask& task, int nblocks, bool parallel) {
+    int nthreads = parallel ? std::min(QThread::idealThreadCount(), nblocks) : 1;
+    if (nthreads <= 1) {
+        for (int b = 0; b < nblocks; b++) task.block(b);
+        return;
+    }
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(nthreads);
+    for (int t = 0; t < nthreads; t++) pool.start(new BlockRunnable(&task, t, nthreads, nblocks));
+    pool.waitForDone();
+}
+
+
+// block size of the filtered noise generators, fixed so that the noise does not depend on the number of threads
+static const int iir_block = 1 << 16;
+
+// random generator of block b: xorshift seeded by a hash of seed and block
+class BlockRandom {
+public:
+    BlockRandom(int seed, int b) {
+        unsigned int h = (unsigned int)(seed) * 2654435761u ^ (unsigned int)(b) * 0x85ebca6bu ^ 0x9e3779b9u;
+        h ^= h >> 16; h *= 0x85ebca6bu; h ^= h >> 13; h *= 0xc2b2ae35u; h ^= h >> 16;
+        state = h ? h : 1;
+    }
+
+    // uniform in (0,1)
+    double uniform() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return (state + 0.5) / 4294967296.0;
+    }
+
+    // n standard normal numbers, Box-Muller on arrays so that the transform can be vectorized
+    void gaussian(double* z, int n) {
+        int n2 = (n+1)/2;
+        u.resize(2*n2);
+        for (int i = 0; i < 2*n2; i++) u[i] = uniform();
+
+        g.resize(2*n2);
+        const double * u1 = &u[0];
+        const double * u2 = &u[n2];
+        double * g1 = &g[0];
+        double * g2 = &g[n2];
+        for (int i = 0; i < n2; i++) {
+            double r = sqrt(-2.0 * log(u1[i]));
+            double t = 2*3.141592653589793 * u2[i];
+            g1[i] = r * cos(t);
+            g2[i] = r * sin(t);
+        }
+        std::copy(g.begin(), g.begin() + n, z);
+    }
+
+private:
+    unsigned int state;
+    std::vector<double> u, g;
+};
+
+
+// second order IIR filter y_n = b0 x_n + b1 x_n-1 + b2 x_n-2 - a1 y_n-1 - a2 y_n-2 in direct form II transposed:
+// y = b0 x + s1, s1' = -a1 s1 + s2 + g1 x, s2' = -a2 s1 + g2 x with g1 = b1 - a1 b0, g2 = b2 - a2 b0
+// pass 1 filters each block from zero state, the block start states are then propagated by M^L and
+// pass 2 adds the response to the start state: y_n += (M^n s)_1 with M = [[-a1, 1], [-a2, 0]]
+class IIRNoiseTask : public BlockTask {
+public:
+    IIRNoiseTask(int n, const double* b, const double* a, double scale, int seed, DataTYPE off, DataTYPE* v,
+                 const CancelFlag* cancel)
+        : n(n), b0(b[0]), a1(a[1]), a2(a[2]), scale(scale), seed(seed), off(off), v(v), pass(1), cancel(cancel) {
+        g1 = b[1] - a1 * b0;
+        g2 = b[2] - a2 * b0;
+        nblocks = (n + iir_block - 1) / iir_block;
+        s1.resize(nblocks); s2.resize(nblocks);
+    }
+
+    void block(int b) {
+        if (cancelled(cancel)) return;
+        int i0 = b * iir_block;
+        int nb = std::min(iir_block, n - i0);
+        DataTYPE * vb = v + i0;
+
+        if (pass == 1) {
+            std::vector<double> x(nb);
+            BlockRandom rnd(seed, b);
+            rnd.gaussian(&x[0], nb);
+
+            double t1 = 0, t2 = 0, t, xi;
+            for (int i = 0; i < nb; i++) {
+                xi = scale * x[i];
+                vb[i] = b0 * xi + t1;
+                t = -a1 * t1 + t2 + g1 * xi;
+                t2 = -a2 * t1 + g2 * xi;
+                t1 = t;
+            }
+            s1[b] = t1; s2[b] = t2;  // end state from zero start
+
+        } else {
+            double t1 = s1[b], t2 = s2[b], t;
+            DataTYPE x;
+            for (int i = 0; i < nb; i++) {
+                x = vb[i] + t1;
+                vb[i] = x + off;
+                t = -a1 * t1 + t2;
+                t2 = -a2 * t1;
+                t1 = t;
+            }
+        }
+    }
+
+    int n, nblocks;
+    double b0, a1, a2, g1, g2, scale;
+    int seed;
+    DataTYPE off;
+    DataTYPE* v;
+    int pass;
+    std::vector<double> s1, s2;  // end states of pass 1, then start states of pass 2
+    const CancelFlag* cancel;
+};
+
+
+// stationary variance of the filter output for unit white noise input from the discrete Lyapunov equation
+// P = M P M^T + g g^T of the state; the stationary state covariance is returned in p11, p12, p22
+static double iir_variance(const double* b, const double* a, double& p11, double& p12, double& p22) {
+    double a1 = a[1], a2 = a[2];
+    double g1 = b[1] - a1 * b[0];
+    double g2 = b[2] - a2 * b[0];
+
+    p11 = (g1*g1 + g2*g2 - 2*a1*g1*g2/(1+a2)) / (1 - a1*a1 - a2*a2 + 2*a1*a1*a2/(1+a2));
+    p12 = (a1*a2*p11 + g1*g2) / (1+a2);
+    p22 = a2*a2*p11 + g2*g2;
+
+    return p11 + b[0]*b[0];
+}
+
+
+// gaussian white noise through a second order IIR filter, block parallel
+void create_iir_noise(int n, const double b[3], const double a[3], DataTYPE sigma, int seed,
+                      DataTYPE off, DataTYPE* v, bool parallel, const CancelFlag* cancel) {
+    if (n <= 0) return;
+
+    double p11, p12, p22;
+    double var = iir_variance(b, a, p11, p12, p22);
+    double scale = var > 0 ? sigma / sqrt(var) : 0;
+
+    IIRNoiseTask task(n, b, a, scale, seed, off, v, cancel);
+    run_blocks(task, task.nblocks, parallel && n > iir_block);
+    if (cancelled(cancel)) return;
+
+    // start in the stationary state: state of covariance scale^2 P, drawn from its own random block
+    BlockRandom rnd(seed, -1);
+    double z[2];
+    rnd.gaussian(z, 2);
+    double q11 = sqrt(std::max(p11, 0.0));
+    double c1 = q11 * z[0];
+    double c2 = (q11 > 0 ? p12 / q11 * z[0] + sqrt(std::max(p22 - p12*p12/p11, 0.0)) * z[1] : sqrt(std::max(p22, 0.0)) * z[1]);
+    c1 *= scale; c2 *= scale;
+
+    // M^L for the propagation of the start states over full blocks
+    double m11 = 1, m12 = 0, m21 = 0, m22 = 1;     // result
+    double q[4] = {-a[1], 1, -a[2], 0};           // M^(2^k)
+    for (int k = iir_block; k > 0; k >>= 1) {
+        double t11, t12, t21, t22;
+        if (k & 1) {
+            t11 = m11*q[0] + m12*q[2]; t12 = m11*q[1] + m12*q[3];
+            t21 = m21*q[0] + m22*q[2]; t22 = m21*q[1] + m22*q[3];
+            m11 = t11; m12 = t12; m21 = t21; m22 = t22;
+        }
+        t11 = q[0]*q[0] + q[1]*q[2]; t12 = q[0]*q[1] + q[1]*q[3];
+        t21 = q[2]*q[0] + q[3]*q[2]; t22 = q[2]*q[1] + q[3]*q[3];
+        q[0] = t11; q[1] = t12; q[2] = t21; q[3] = t22;
+    }
+
+    for (int k = 0; k < task.nblocks; k++) {
+        double e1 = task.s1[k], e2 = task.s2[k];
+        task.s1[k] = c1;
+        task.s2[k] = c2;
+        // start of the next block: zero state response plus the propagated start state
+        double n1 = e1 + m11 * c1 + m12 * c2;
+        double n2 = e2 + m21 * c1 + m22 * c2;
+        c1 = n1; c2 = n2;
+    }
+
+    task.pass = 2;
+    run_blocks(task, task.nblocks, parallel && n > iir_block);
+}
+
+
+// Ornstein-Uhlenbeck process x_n = a x_n-1 + c xi_n with a = exp(-dt/tau), exact for any dt
+void create_ou_noise(DataTYPE dur, DataTYPE samp, DataTYPE tau, DataTYPE sigma, int seed,
+                     DataTYPE off, DataTYPE* v, bool parallel, const CancelFlag* cancel) {
+    DataTYPE dt = 1.0 /samp / 1000.0;
+    double ea = tau > 0 ? exp(-dt / (tau / 1000.0)) : 0;
+
+    double b[3] = {1, 0, 0};
+    double a[3] = {1, -ea, 0};
+    create_iir_noise(noise_length(dur, samp), b, a, sigma, seed, off, v, parallel, cancel);
+}
+
+bool create_ou_noise(DataTYPE dur, DataTYPE samp, DataTYPE tau, DataTYPE sigma, int seed,
+                     DataVECTOR& v) {
+    v.resize(noise_length(dur, samp));
+    create_ou_noise(dur, samp, tau, sigma, seed, 0, &v[0]);
+    return true;
+}
+
+
+// second order Butterworth low pass by the bilinear transform
+void create_filtered_noise(DataTYPE dur, DataTYPE samp, DataTYPE fc, DataTYPE sigma, int seed,
+                           DataTYPE off, DataTYPE* v, bool parallel, const CancelFlag* cancel) {
+    DataTYPE dt = 1.0 /samp / 1000.0;
+    double k = tan(3.141592653589793 * std::min(double(fc) * dt, 0.49));
+    double norm = 1.0 / (1.0 + sqrt(2.0) * k + k * k);
+
+    double b[3] = {k * k * norm, 2 * k * k * norm, k * k * norm};
+    double a[3] = {1, 2 * (k * k - 1) * norm, (1 - sqrt(2.0) * k + k * k) * norm};
+    create_iir_noise(noise_length(dur, samp), b, a, sigma, seed, off, v, parallel, cancel);
+}
 
+bool create_filtered_noise(DataTYPE dur, DataTYPE samp, DataTYPE fc, DataTYPE sigma, int seed,
+                           DataVECTOR& v) {
+    v.resize(noise_length(dur, samp));
+    create_filtered_noise(dur, samp, fc, sigma, seed, 0, &v[0]);
     return true;
+}
+
+
+/* create a noise stimulus of duration dur [sec] with uniform frequency spectrum from f0 to f1 [Hz] with standard deviation sigma add constant stimulation offset off
+ * add LFP like signal underneath with amplitude amp / phase and freqeuncy omega [Hz]
+ * assume sampling frequency of samp [kHz]
+ */
+bool create_noise(DataTYPE dur, DataTYPE samp,
+                              DataTYPE ff,  DataTYPE phase, DataTYPE amp,
+                              DataTYPE f0, DataTYPE f1, DataTYPE sigma, int seed,
+                              DataVECTOR& v, const NoiseShape* shape) {
+    DEBUG("create_noise")
+
+    //working own fft.h version with optimized sample size, split into the stages below
+
+    NoiseWorkspace w;
+    w.setup(dur, samp);
+
+    create_noise_spectrum(dur, f0, f1, seed, w, shape);
+
+    return synthesize_noise(samp, ff, phase, amp, sigma, w, v);
 
 
 
@@ -594,35 +1283,285 @@ bool create_noise(DataTYPE dur, DataTYPE samp,
 }
 
 
+// multi-rate generation
+
+// modified Bessel function I0 by its power series
+static double bessel_i0(double x) {
+    double sum = 1, term = 1, q = x * x / 4;
+    for (int k = 1; k < 100 && term > 1e-17 * sum; k++) {
+        term *= q / (double(k) * k);
+        sum += term;
+    }
+    return sum;
+}
+
+Interpolator::Interpolator(int factor, int taps, double beta) : L(std::max(factor, 1)), K(std::max(taps / 2 * 2, 2)) {
+    // g(k) = sinc(k / L) * kaiser(k / (K L / 2)) for |k| <= K L / 2
+    int half = K * L / 2;
+    kernel.resize(2 * half + 1);
+    double i0b = bessel_i0(beta);
+    for (int k = -half; k <= half; k++) {
+        double u = double(k) / half;
+        double s = (k == 0) ? 1 : sin(pi * k / L) / (pi * k / L);
+        kernel[k + half] = s * bessel_i0(beta * sqrt(std::max(1 - u * u, 0.0))) / i0b;
+    }
+
+    // phase r, tap t: g(r + (t - K/2) L), each phase normalized to unit gain at zero frequency
+    coef.resize(L * (K + 1));
+    for (int r = 0; r < L; r++) {
+        double sum = 0;
+        for (int t = 0; t <= K; t++) {
+            int k = r + (t - K/2) * L;
+            coef[r * (K + 1) + t] = (k >= -half && k <= half) ? kernel[k + half] : 0;
+            sum += coef[r * (K + 1) + t];
+        }
+        for (int t = 0; t <= K; t++) coef[r * (K + 1) + t] /= sum;
+    }
+
+    coef_t.resize(L * (K + 1));
+    for (int r = 0; r < L; r++) {
+        for (int t = 0; t <= K; t++) coef_t[t * L + r] = coef[r * (K + 1) + t];
+    }
+
+    // the kernel as used, for the error bound
+    for (int r = 0; r < L; r++) {
+        for (int t = 0; t <= K; t++) {
+            int k = r + (t - K/2) * L;
+            if (k >= -half && k <= half) kernel[k + half] = coef[r * (K + 1) + t];
+        }
+    }
+    for (int k = 1; k <= half; k++) kernel[half - k] = kernel[half + k];
+}
+
+void Interpolator::upsample(const double* x, int n, DataTYPE off, DataTYPE* v) const {
+    if (n <= 0) return;
+
+    // the L outputs of low rate sample i are one matrix-vector product with tap major coefficients,
+    // so the inner loop runs over contiguous outputs
+    int ni = (n - 1) / L + 1;
+    std::vector<double> acc(L);
+    for (int i = 0; i < ni; i++) {
+        std::fill(acc.begin(), acc.end(), 0.0);
+        for (int t = 0; t <= K; t++) {
+            const double* c = &coef_t[t * L];
+            double xt = x[i + K - t];
+            for (int r = 0; r < L; r++) acc[r] += c[r] * xt;
+        }
+
+        int m = std::min(L, n - i * L);
+        DataTYPE* out = v + i * L;
+        for (int r = 0; r < m; r++) out[r] = acc[r] + off;
+    }
+}
+
+double Interpolator::error_bound(double band) const {
+    if (L <= 1) return 0;
+    band = std::min(std::max(band, 0.0), 1.0);
+
+    // zero phase response at nu = f / low rate, H(0) = L
+    int half = K * L / 2;
+    const int ngrid = 64;
+    double pass = 0, images = 0;
+
+    // passband [0, band / 2], image k: [k - band / 2, k + band / 2] within [0, L / 2]
+    for (int k = 0; k <= L / 2; k++) {
+        double lo = std::max(k - band / 2, 0.0);
+        double hi = std::min(k + band / 2, L / 2.0);
+        double gmax = 0;
+        for (int j = 0; j <= ngrid; j++) {
+            double nu = lo + (hi - lo) * j / ngrid;
+            double h = kernel[half];
+            for (int q = 1; q <= half; q++) h += 2 * kernel[half + q] * cos(2 * pi * nu * q / L);
+            h /= L;
+            if (k == 0) gmax = std::max(gmax, fabs(h - 1));
+            else gmax = std::max(gmax, fabs(h));
+        }
+        if (k == 0) pass = gmax;
+        else images += (2 * k == L) ? gmax : 2 * gmax;  // images below and above k, mirrored at L/2
+    }
+
+    return pass + images;
+}
+
+
+int multirate_factor(DataTYPE samp, DataTYPE fmax) {
+    if (fmax <= 0) return 1;
+    int factor = std::min(int(samp * 1000 / (8 * fmax)), 64);
+    return factor >= 4 ? factor : 1;
+}
+
+double multirate_error(int factor, DataTYPE samp, DataTYPE fmax) {
+    if (factor <= 1) return 0;
+    double nyquist = samp * 1000 / factor / 2;
+    return Interpolator(factor).error_bound(fmax / nyquist);
+}
+
+void create_zap_multirate(int type, DataTYPE dur, DataTYPE samp,
+                          DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse, int factor,
+                          DataTYPE off, DataTYPE* v, const CancelFlag* cancel) {
+    if (factor <= 1) {
+        zap(type, dur, samp, f0, f1, amp, reverse, true, off, v, cancel);
+        return;
+    }
+
+    int n = template_length(dur, samp);
+    Interpolator ip(factor);
+    int k2 = ip.taps() / 2;
+
+    // the phase continues analytically beyond the ends, so the filter sees the zap itself there
+    double dt = factor / double(samp) / 1000.0;
+    double e = exp(1);
+    double ph0 = zap_phase0<double, double>(type, dur, f0, f1, reverse, pi, e);
+
+    std::vector<double> x(ip.input_length(n));
+    for (int j = 0; j < int(x.size()); j++) {
+        if (j % zap_block == 0 && cancelled(cancel)) return;
+        x[j] = amp * sin(zap_phase<double, double>(type, (j - k2) * dt, dur, f0, f1, reverse, ph0, pi, e));
+    }
+
+    ip.upsample(&x[0], n, off, v);
+}
+
+
 /* create a sin stimulus of duration \param dur [sec] assuming a sampling frequency of \param samp [kHz]
  * with amplitude \param amp and phase \param phase and freqeuncy \\param ff [Hz]
  */
-bool create_sin(DataTYPE dur, DataTYPE samp,
+void create_sin(DataTYPE dur, DataTYPE samp,
                             DataTYPE ff,  DataTYPE phase, DataTYPE amp,
                             DataTYPE ff2,  DataTYPE phase2, DataTYPE amp2,
                             bool positive,
-                            DataVECTOR& v) {
+                            DataTYPE off, DataTYPE* v, const CancelFlag* cancel) {
     DEBUG("create_sin")
 
     DataTYPE dt = 1.0 / samp / 1000.0;
-    int n = int(dur * samp * 1000) + 1;
+    int n = template_length(dur, samp);
 
-    v.resize(n);
     // sine wave
+    DataTYPE x;
     for (int i = 0; i < n; i++) {
-        v[i] = amp * sin(2*3.141592653589793*ff*i*dt+phase) +  amp2 * sin(2*3.141592653589793*ff2*i*dt+phase2);
+        if (i % zap_block == 0 && cancelled(cancel)) return;
+        x = amp * sin(2*3.141592653589793*ff*i*dt+phase) +  amp2 * sin(2*3.141592653589793*ff2*i*dt+phase2);
         if (positive) {
-            if (v[i] <0) v[i]= 0;
+            if (x <0) x= 0;
             else if (ff2 > 0 && sin(2*3.141592653589793*ff2*i*dt+phase2) < 0)
-                    v[i] = 0;
+                    x = 0;
         }
+        v[i] = x + off;
     }
+}
 
+bool create_sin(DataTYPE dur, DataTYPE samp,
+                            DataTYPE ff,  DataTYPE phase, DataTYPE amp,
+                            DataTYPE ff2,  DataTYPE phase2, DataTYPE amp2,
+                            bool positive,
+                            DataVECTOR& v) {
+    v.resize(template_length(dur, samp));
+    create_sin(dur, samp, ff, phase, amp, ff2, phase2, amp2, positive, 0, &v[0]);
     return true;
 }
 
 
 
+// step protocols
+
+StepProtocol::StepProtocol(DataTYPE samp) : samp(samp), time(0) {
+    start.push_back(0);
+}
+
+void StepProtocol::clear() {
+    segment.clear();
+    start.clear();
+    start.push_back(0);
+    time = 0;
+}
+
+void StepProtocol::add(double dur, double level, double ramp) {
+    if (dur <= 0) return;
+
+    // boundaries from the accumulated time so that rounding does not add up
+    time += dur;
+    segment.push_back(StepSegment(dur, level, ramp));
+    start.push_back(int(time * samp * 1000 + 0.5));
+}
+
+void StepProtocol::add_pulse_train(int n, double width, double interval, double amp, double base) {
+    for (int i = 0; i < n; i++) {
+        add(width, base + amp);
+        add(interval - width, base);
+    }
+}
+
+void StepProtocol::add_steps(int n, double dur, double first, double increment, double rest, double base) {
+    for (int i = 0; i < n; i++) {
+        add(dur, first + i * increment);
+        add(rest, base);
+    }
+}
+
+bool StepProtocol::read(const std::string& file_name) {
+    std::ifstream file(file_name.c_str());
+    if (!file.is_open()) return false;
+
+    clear();
+
+    double dur, level, ramp;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream str(line);
+        if (!(str >> dur >> level)) return false;
+        if (!(str >> ramp)) ramp = 0;
+        add(dur, level, ramp);
+    }
+
+    return !segment.empty();
+}
+
+bool StepProtocol::constant() const {
+    for (int i = 0; i < int(segment.size()); i++) {
+        if (segment[i].ramp != 0) return false;
+    }
+    return true;
+}
+
+void StepProtocol::expand(int from, int n, DataTYPE off, DataTYPE* v) const {
+    int end = from + n;
+    int k = int(std::upper_bound(start.begin(), start.end(), from) - start.begin()) - 1;
+
+    for (int i = from; i < end; k++) {
+        int e = std::min(end, k < int(segment.size()) ? start[k+1] : end);
+
+        if (k >= int(segment.size())) { // beyond the end: offset only
+            std::fill(v + (i - from), v + (e - from), off);
+        } else if (segment[k].ramp == 0) {
+            std::fill(v + (i - from), v + (e - from), DataTYPE(segment[k].level + off));
+        } else {
+            double slope = segment[k].ramp / std::max(start[k+1] - start[k], 1);
+            for (int j = i; j < e; j++) v[j - from] = segment[k].level + slope * (j - start[k]) + off;
+        }
+        i = e;
+    }
+}
+
+void StepProtocol::expand(DataVECTOR& v) const {
+    v.resize(length());
+    if (!v.empty()) expand(0, length(), 0, &v[0]);
+}
+
+void StepProtocol::breakpoints(std::vector<double>& t, std::vector<double>& y) const {
+    t.clear(); y.clear();
+    double ts = 0;
+    for (int i = 0; i < int(segment.size()); i++) {
+        t.push_back(ts);
+        y.push_back(segment[i].level);
+        ts += segment[i].dur;
+        t.push_back(ts);
+        y.push_back(segment[i].level + segment[i].ramp);
+    }
+}
+
+
+
 /*****************************************************************************************************************
  *
  *      Data Analysis
@@ -646,15 +1585,28 @@ void reverse_data(DataVECTOR& d) {
 
 
 //detect offsets
-void first_non_zero(const DataVECTOR& d1, int& p, const DataTYPE& zero){
+//the scan tests whole blocks with a branch free loop the compiler vectorizes, only the block
+//containing the hit is searched sample by sample
+static const int scan_block = 16;
+
+static inline bool block_non_zero(const DataTYPE* x, DataTYPE zero, DataTYPE eps) {
+    int hit = 0;
+    for (int j = 0; j < scan_block; j++) hit |= (fabs(x[j] - zero) > eps);
+    return hit != 0;
+}
+
+void first_non_zero(const DataVIEW& d1, int& p, const DataTYPE& zero, const DataTYPE& eps){
     p = 0; int n = d1.size();
-    while (p <n && d1[p] == zero) p++;
+    const DataTYPE* x = d1.begin();
+    while (p + scan_block <= n && !block_non_zero(x + p, zero, eps)) p += scan_block;
+    while (p <n && !(fabs(x[p] - zero) > eps)) p++;
 }
 
-//detect offsets
-void last_non_zero(const DataVECTOR& d1, int& p, const DataTYPE& zero){
+void last_non_zero(const DataVIEW& d1, int& p, const DataTYPE& zero, const DataTYPE& eps){
     int n = d1.size(); p = n-1;
-    while (p >= 0 && d1[p] == zero) p--;
+    const DataTYPE* x = d1.begin();
+    while (p - scan_block + 1 >= 0 && !block_non_zero(x + p - scan_block + 1, zero, eps)) p -= scan_block;
+    while (p >= 0 && !(fabs(x[p] - zero) > eps)) p--;
     p = n-1-p;
 }
 
@@ -680,10 +1632,28 @@ void remove_ends(DataVECTOR& d1, int n1, int n2){
     d1 = v;
 }
 
+void remove_ends(DataVIEW& d1, int n1, int n2){
+    int n = d1.size();
+    if (n==0) return;
+
+    //same safety as for vectors: keep at least the first number
+    if ((n1 + n2) > n) {
+        d1.length = 1;
+        return;
+    }
+
+    d1.offset += n1;
+    d1.length -= n1 + n2;
+}
+
 
 //smooth data
-void smooth_data(DataVECTOR& data, const int& width, DataVECTOR& smooth){
+void smooth_data(const DataVIEW& data, const int& width, DataVECTOR& smooth){
     int n = data.size();
+    if (n == 0) {
+        smooth.clear();
+        return;
+    }
     int n2 = ceil(double(n)/width);
     DataTYPE mean;
     smooth.resize(n2);
@@ -708,19 +1678,19 @@ void smooth_data(DataVECTOR& data, const int& width, DataVECTOR& smooth){
 
 
 // peak detection by Tods and Andrews
-void find_peaks(const DataVECTOR& data, const DataTYPE& threshold, std::vector<int>& peaks, int nmax){
-    peaks.clear();
-    int i = 0;
-    int d = 0;
-    int s = 0;
-    DataTYPE qa = data[0], qb = data[0], qi;
-    int n= data.size();
-    int np = 0; int nm = nmax;
-    if (nmax<0) nm = n+1;
+// state of the detector after a sample, shared by the serial and the parallel version so both decide identically
+struct PeakState {
+    int d;          // slope: 1 rising, -1 falling, 0 undecided
+    int s;          // possible peak
+    DataTYPE qa, qb; // high and low data
 
-    while (i < n-1 && np < nm){
-        i++;
-        qi = data[i]; //next data point;
+    PeakState() : d(0), s(0), qa(0), qb(0) {}
+    PeakState(int i, DataTYPE q) : d(0), s(i), qa(q), qb(q) {}
+
+    bool operator==(const PeakState& o) const { return d == o.d && s == o.s && qa == o.qa && qb == o.qb; }
+
+    // next data point qi at position i, returns true if s is a peak
+    bool step(int i, DataTYPE qi, DataTYPE threshold) {
         if (d == 0) {
             if (qa >= qi + threshold) d = -1; // falling slope
             else if (qi >= qb + threshold) d = 1; //rising slop
@@ -732,11 +1702,10 @@ void find_peaks(const DataVECTOR& data, const DataTYPE& threshold, std::vector<i
                 qa = qi; //raise new high data
                 s = i; //i is possible peak
             } else if (qa >= qi + threshold) { // data has fallen below high data - threshold -> peak
-                peaks.push_back(s);
-                np++;
                 qb = qi; //lower upper data
                 d = -1;  // data is really falling again
                 //s = i; // should not need this only for simultaneous trough detection
+                return true;
             }
         } else if (d<0) { // data was falling
             if (qi < qb) {// still falling
@@ -746,56 +1715,136 @@ void find_peaks(const DataVECTOR& data, const DataTYPE& threshold, std::vector<i
                 d = 1;
             }
         }
+        return false;
     }
-}
+};
 
+void find_peaks(const DataVIEW& data, const DataTYPE& threshold, std::vector<int>& peaks, int nmax){
+    peaks.clear();
+    if (data.empty()) return;
+    int i = 0;
+    PeakState st(0, data[0]);
+    int n= data.size();
+    int np = 0; int nm = nmax;
+    if (nmax<0) nm = n+1;
 
+    while (i < n-1 && np < nm){
+        i++;
+        if (st.step(i, data[i], threshold)) {
+            peaks.push_back(st.s);
+            np++;
+        }
+    }
+}
 
 
+// chunk of the parallel peak detection and distance of the states kept to compare with the serial run
+static const int peak_chunk = 1 << 18;
+static const int peak_checkpoint = 1 << 12;
+
+// speculative scan of one chunk from a guessed state, keeps the state after early peaks and at checkpoints
+class PeakTask : public BlockTask {
+public:
+    struct Mark {
+        int i;          // state after sample i
+        PeakState st;
+        int np;         // peaks found up to and including sample i
+    };
+
+    struct Chunk {
+        std::vector<int> peaks;
+        std::vector<Mark> marks;
+        PeakState end;
+    };
+
+    PeakTask(const DataVIEW& data, DataTYPE threshold, int nchunks)
+        : data(data), threshold(threshold), chunks(nchunks) {}
+
+    void block(int b) {
+        Chunk& c = chunks[b];
+        int i0 = b * peak_chunk + 1;
+        int i1 = std::min(i0 + peak_chunk, data.size());
+
+        // guess: the detector restarted at the sample before the chunk
+        PeakState st(i0-1, data[i0-1]);
+        for (int i = i0; i < i1; i++) {
+            bool peak = st.step(i, data[i], threshold);
+            if (peak) c.peaks.push_back(st.s);
+            // the states agree soon after a peak, so near the start every peak is a candidate
+            if ((peak && i - i0 < peak_checkpoint) || (i - i0) % peak_checkpoint == peak_checkpoint - 1) {
+                Mark m = {i, st, int(c.peaks.size())};
+                c.marks.push_back(m);
+            }
+        }
+        c.end = st;
+    }
 
-//impedance |ft(ouput)|/|f(input)|^2 here !!
-//todos: speedup: we know that we have real data -> can use real gls
-//       speedup: impedance needs only e calculated to n/2 as it is symmetric from there and gives no information !!
-void impedance(const DataVECTOR& in, const DataVECTOR& out, DataVECTOR& z){
-    DEBUG("impedance()")
+    const DataVIEW& data;
+    DataTYPE threshold;
+    std::vector<Chunk> chunks;
+};
 
+void find_peaks_parallel(const DataVIEW& data, const DataTYPE& threshold, std::vector<int>& peaks, int nmax,
+                         bool parallel){
+    int n = data.size();
+    int nchunks = (n - 1 + peak_chunk - 1) / peak_chunk;
+    if (!parallel || nchunks < 2) {
+        find_peaks(data, threshold, peaks, nmax);
+        return;
+    }
 
-    int n = in.size();
+    PeakTask task(data, threshold, nchunks);
+    run_blocks(task, nchunks, true);
 
-    if (int(out.size()) < n){
-        //batch_error("impedance", "sizes of in and outputs do not match!");
-        return;
+    // stitch: continue the true state into each chunk until it equals a kept state of the guess,
+    // from there on the guess is exact
+    peaks.clear();
+    PeakState st(0, data[0]);
+    for (int b = 0; b < nchunks && (nmax < 0 || int(peaks.size()) < nmax); b++) {
+        PeakTask::Chunk& c = task.chunks[b];
+        int i0 = b * peak_chunk + 1;
+        int i1 = std::min(i0 + peak_chunk, n);
+
+        int m = 0;
+        for (int i = i0; i < i1; i++) {
+            if (st.step(i, data[i], threshold)) peaks.push_back(st.s);
+
+            while (m < int(c.marks.size()) && c.marks[m].i < i) m++;
+            if (m < int(c.marks.size()) && c.marks[m].i == i && c.marks[m].st == st) {
+                peaks.insert(peaks.end(), c.peaks.begin() + c.marks[m].np, c.peaks.end());
+                st = c.end;
+                break;
+            }
+        }
     }
 
+    if (nmax >= 0 && int(peaks.size()) > nmax) peaks.resize(nmax);
 
-    double * din_r = new double[n];
-    double * din_i = new double[n];
-    double * dout_r = new double[n];
-    double * dout_i = new double[n];
+#ifndef QT_NO_DEBUG
+    // debug builds: stitched chunks must give exactly the serial peaks
+    std::vector<int> serial;
+    find_peaks(data, threshold, serial, nmax);
+    Q_ASSERT_X(serial == peaks, "find_peaks_parallel", "peaks differ from find_peaks");
+#endif
+}
 
-    for (int i= 1; i < n; i++) {
-        din_r[i] = in[i];
-        din_i[i] = 0.0;
 
-        dout_r[i] = out[i];
-        dout_i[i] = 0.0;
-    }
 
-    double * fftin_r = new double[n];
-    double * fftin_i = new double[n];
-    double * fftout_r = new double[n];
-    double * fftout_i = new double[n];
 
-    fft(n, din_r, din_i, fftin_r, fftin_i);
-    fft(n, dout_r, dout_i, fftout_r, fftout_i);
+//impedance |ft(ouput)|/|f(input)|^2 here !!
+//todos: speedup: we know that we have real data -> can use real gls
+//       speedup: impedance needs only e calculated to n/2 as it is symmetric from there and gives no information !!
+void impedance(const DataVIEW& in, const DataVIEW& out, DataVECTOR& z){
+    DEBUG("impedance()")
 
-    z.resize(n);
-    for (int i= 0; i < n; i++) {
-        z[i] = ( fftout_r[i]*fftout_r[i] +  fftout_i[i]*fftout_i[i] ) / ( fftin_r[i]* fftin_r[i] +   fftin_i[i]* fftin_i[i] );
+    if (out.size() < in.size()){
+        //batch_error("impedance", "sizes of in and outputs do not match!");
+        return;
     }
 
-    delete [] din_r; delete [] din_i; delete [] fftin_r; delete [] fftin_i;
-    delete [] dout_r; delete [] dout_i; delete [] fftout_r; delete [] fftout_i;
+    ImpedanceSpectrum spectrum;
+    spectrum.set_stimulus(in);
+    spectrum.response(out, z);
 
     return;
 
@@ -848,18 +1897,296 @@ void impedance(const DataVECTOR& in, const DataVECTOR& out, DataVECTOR& z){
 }
 
 
+void ImpedanceSpectrum::setup(int m) {
+    if (m == n) return;
+    n = m;
 
+    // even lengths: samples 2j and 2j+1 as real and imaginary part of a transform of half the length
+    int nc = (n % 2 == 0) ? n / 2 : n;
+    plan.setup(std::max(nc, 1));
+    x_r.resize(nc); x_i.resize(nc);
+    y_r.resize(nc); y_i.resize(nc);
 
+    int nf = frequencies();
+    in_r.resize(nf); in_i.resize(nf);
+    out_r.resize(nf); out_i.resize(nf);
 
+    tw_r.resize(nf); tw_i.resize(nf);
+    for (int k = 0; k < nf; k++) {
+        tw_r[k] = cos(2 * pi * k / n);
+        tw_i[k] = -sin(2 * pi * k / n);
+    }
 
+    stimulus.clear();
+}
 
+// half spectrum of real x
+void ImpedanceSpectrum::transform(const DataVIEW& x, std::vector<double>& re, std::vector<double>& im) {
+    const DataTYPE* d = x.begin();
+    int nf = frequencies();
 
+    if (n % 2 != 0) {
+        for (int i = 0; i < n; i++) {
+            x_r[i] = d[i];
+            x_i[i] = 0.0;
+        }
+        plan.execute(&x_r[0], &x_i[0], &y_r[0], &y_i[0]);
+        for (int k = 0; k < nf; k++) {
+            re[k] = y_r[k];
+            im[k] = y_i[k];
+        }
+        return;
+    }
 
+    int nc = n / 2;
+    for (int j = 0; j < nc; j++) {
+        x_r[j] = d[2 * j];
+        x_i[j] = d[2 * j + 1];
+    }
+    plan.execute(&x_r[0], &x_i[0], &y_r[0], &y_i[0]);
+
+    // even E = (Z_k + conj Z_-k) / 2 and odd O = (Z_k - conj Z_-k) / 2i samples, X_k = E_k + w^k O_k
+    for (int k = 0; k < nf; k++) {
+        int k1 = k % nc, k2 = (nc - k) % nc;
+        double er = (y_r[k1] + y_r[k2]) / 2, ei = (y_i[k1] - y_i[k2]) / 2;
+        double or_ = (y_i[k1] + y_i[k2]) / 2, oi = (y_r[k2] - y_r[k1]) / 2;
+        re[k] = er + tw_r[k] * or_ - tw_i[k] * oi;
+        im[k] = ei + tw_r[k] * oi + tw_i[k] * or_;
+    }
+}
 
+bool ImpedanceSpectrum::set_stimulus(const DataVIEW& in) {
+    if (in.size() == n && int(stimulus.size()) == n && std::equal(in.begin(), in.end(), stimulus.begin())) return false;
 
+    setup(in.size());
+    stimulus.assign(in.begin(), in.end());
+    if (n > 0) transform(in, in_r, in_i);
+    return true;
+}
 
+void ImpedanceSpectrum::response(const DataVIEW& out, DataVECTOR& magnitude, DataVECTOR& phase) {
+    int nf = frequencies();
+    magnitude.assign(nf, 0);
+    phase.assign(nf, 0);
+    if (n == 0 || out.size() < n) return;
+
+    transform(out, out_r, out_i);
+
+    // Z = out / in = out conj(in) / |in|^2
+    for (int k = 0; k < nf; k++) {
+        double p = in_r[k] * in_r[k] + in_i[k] * in_i[k];
+        if (p <= 0) continue;
+        double zr = (out_r[k] * in_r[k] + out_i[k] * in_i[k]) / p;
+        double zi = (out_i[k] * in_r[k] - out_r[k] * in_i[k]) / p;
+        magnitude[k] = sqrt(zr * zr + zi * zi);
+        phase[k] = atan2(zi, zr);
+    }
+}
 
+void ImpedanceSpectrum::response(const DataVIEW& out, DataVECTOR& z2) {
+    int nf = frequencies();
+    z2.assign(nf, 0);
+    if (n == 0 || out.size() < n) return;
 
+    transform(out, out_r, out_i);
+
+    for (int k = 0; k < nf; k++) {
+        double p = in_r[k] * in_r[k] + in_i[k] * in_i[k];
+        if (p > 0) z2[k] = (out_r[k] * out_r[k] + out_i[k] * out_i[k]) / p;
+    }
+}
 
 
 
+/*****************************************************************************************************************
+ *
+ *      Resonance Fit
+ *
+ *****************************************************************************************************************/
+
+// fit in log parameters p = (log amp, log f0, log q) so that all stay positive,
+// residuals r = log z - log model
+class ResonanceModel {
+public:
+    ResonanceModel(const DataVIEW& z, double f_first, double df) {
+        for (int i = 0; i < z.size(); i++) {
+            if (z[i] > 0) {
+                f.push_back(f_first + i * df);
+                y.push_back(log(double(z[i])));
+            }
+        }
+    }
+
+    int size() const { return int(f.size()); }
+
+    // half the sum of squared residuals, with jtj and jtr if given
+    double cost(const double p[3], double jtj[3][3] = 0, double jtr[3] = 0) const {
+        double f0 = exp(p[1]), q2 = exp(2 * p[2]);
+        if (jtj) {
+            for (int a = 0; a < 3; a++) {
+                jtr[a] = 0;
+                for (int b = 0; b < 3; b++) jtj[a][b] = 0;
+            }
+        }
+
+        double c = 0;
+        for (int i = 0; i < size(); i++) {
+            double u = f[i] / f0, u2 = u * u;
+            double d = (1 - u2) * (1 - u2) + u2 / q2;
+            double r = y[i] - (p[0] - log(d));
+            c += r * r;
+
+            if (jtj) {
+                // derivatives of the residual
+                double du = -4 * u * (1 - u2) + 2 * u / q2;
+                double j[3] = {-1.0, -u * du / d, -2 * u2 / (q2 * d)};
+                for (int a = 0; a < 3; a++) {
+                    jtr[a] += j[a] * r;
+                    for (int b = 0; b < 3; b++) jtj[a][b] += j[a] * j[b];
+                }
+            }
+        }
+        return c / 2;
+    }
+
+    // total variance of log z for r2
+    double variance() const {
+        double m = 0, v = 0;
+        for (int i = 0; i < size(); i++) m += y[i];
+        m /= size();
+        for (int i = 0; i < size(); i++) v += (y[i] - m) * (y[i] - m);
+        return v;
+    }
+
+    // start values: f0 at the maximum, amp at the lowest frequency, q from the height of the maximum
+    void guess(double p[3]) const {
+        int k = int(std::max_element(y.begin(), y.end()) - y.begin());
+        double peak = exp((y[k] - y[0]) / 2);
+        p[0] = y[0];
+        p[1] = log(std::max(f[k], f[0] > 0 ? f[0] : 1e-3));
+        p[2] = log(std::max(peak, 0.75));
+    }
+
+private:
+    std::vector<double> f, y;
+};
+
+// solves a x = b for a symmetric positive 3x3 matrix, false if singular
+static bool solve3(double a[3][3], const double b[3], double x[3]) {
+    double m[3][4];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) m[i][j] = a[i][j];
+        m[i][3] = b[i];
+    }
+    for (int c = 0; c < 3; c++) {
+        int piv = c;
+        for (int r = c + 1; r < 3; r++) if (fabs(m[r][c]) > fabs(m[piv][c])) piv = r;
+        if (fabs(m[piv][c]) < 1e-300) return false;
+        for (int j = 0; j < 4; j++) std::swap(m[c][j], m[piv][j]);
+        for (int r = 0; r < 3; r++) {
+            if (r == c) continue;
+            double g = m[r][c] / m[c][c];
+            for (int j = c; j < 4; j++) m[r][j] -= g * m[c][j];
+        }
+    }
+    for (int i = 0; i < 3; i++) x[i] = m[i][3] / m[i][i];
+    return true;
+}
+
+// Levenberg-Marquardt from p, returns the number of iterations or -1 if it failed
+static int levenberg_marquardt(const ResonanceModel& model, double p[3], double& c) {
+    const int max_iter = 200;
+    double lambda = 1e-3;
+    double jtj[3][3], jtr[3];
+    c = model.cost(p, jtj, jtr);
+
+    for (int it = 1; it <= max_iter; it++) {
+        double a[3][3], step[3], b[3];
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) a[i][j] = jtj[i][j];
+            a[i][i] += lambda * (jtj[i][i] > 0 ? jtj[i][i] : 1);
+            b[i] = -jtr[i];
+        }
+        if (!solve3(a, b, step)) return -1;
+
+        double pn[3] = {p[0] + step[0], p[1] + step[1], p[2] + step[2]};
+        double cn = model.cost(pn);
+        if (cn == cn && cn < c) {
+            bool done = (c - cn) < 1e-12 * (c + 1e-300);
+            for (int i = 0; i < 3; i++) p[i] = pn[i];
+            c = model.cost(p, jtj, jtr);
+            lambda = std::max(lambda / 10, 1e-12);
+            if (done || fabs(step[0]) + fabs(step[1]) + fabs(step[2]) < 1e-10) return it;
+        } else {
+            lambda *= 10;
+            if (lambda > 1e12) return it; // no further decrease possible: at the minimum
+        }
+    }
+    return max_iter;
+}
+
+bool fit_resonance(const DataVIEW& z, double f_first, double df, ResonanceFit& fit, bool warm) {
+    ResonanceModel model(z, f_first, df);
+    int m = model.size();
+    if (m < 4) {
+        fit.valid = false;
+        return false;
+    }
+
+    // warm start, falls back to the guess if it ends worse than the guess would
+    double p[3], c = 0;
+    int it = -1;
+    if (warm && fit.valid && fit.amp > 0 && fit.f0 > 0 && fit.q > 0) {
+        p[0] = log(fit.amp); p[1] = log(fit.f0); p[2] = log(fit.q);
+        it = levenberg_marquardt(model, p, c);
+    }
+    double pg[3], cg = 0;
+    model.guess(pg);
+    if (it < 0 || c > model.cost(pg)) {
+        it = levenberg_marquardt(model, pg, cg);
+        for (int i = 0; i < 3; i++) p[i] = pg[i];
+        c = cg;
+    }
+    if (it < 0) {
+        fit.valid = false;
+        return false;
+    }
+
+    double jtj[3][3], jtr[3];
+    model.cost(p, jtj, jtr);
+
+    // covariance s^2 (J^T J)^-1
+    double s2 = 2 * c / std::max(m - 3, 1);
+    double cov[3][3];
+    for (int k = 0; k < 3; k++) {
+        double e[3] = {0, 0, 0}, x[3];
+        e[k] = 1;
+        if (!solve3(jtj, e, x)) {
+            fit.valid = false;
+            return false;
+        }
+        for (int i = 0; i < 3; i++) cov[i][k] = s2 * x[i];
+    }
+
+    fit.amp = exp(p[0]);
+    fit.f0 = exp(p[1]);
+    fit.q = exp(p[2]);
+    fit.q_err = fit.q * sqrt(std::max(cov[2][2], 0.0));
+    fit.iterations = it;
+    double v = model.variance();
+    fit.r2 = v > 0 ? 1 - 2 * c / v : 0;
+
+    // maximum of the model at f0 sqrt(1 - 1/(2 q^2)), error by linearization in the log parameters
+    double h = 1 - 1 / (2 * fit.q * fit.q);
+    if (h > 0) {
+        fit.fres = fit.f0 * sqrt(h);
+        double g1 = fit.fres, g2 = fit.f0 / (2 * sqrt(h) * fit.q * fit.q);
+        fit.fres_err = sqrt(std::max(g1 * g1 * cov[1][1] + 2 * g1 * g2 * cov[1][2] + g2 * g2 * cov[2][2], 0.0));
+    } else {
+        fit.fres = 0;
+        fit.fres_err = 0;
+    }
+
+    fit.valid = true;
+    return true;
+}
@@ -13,13 +13,63 @@
 #include <string>
 #include <vector>
 
+#include "fft.h"
+
 typedef float DataTYPE; //heka uses floats
 typedef std::vector<DataTYPE> DataVECTOR;
 
+
+/*! non-owning view of \ref length samples starting at \ref offset of \ref data, e.g. a trimmed part of a
+ *  DataVECTOR. Trimming only moves offset and length, the viewed data have to outlive the view and must not
+ *  be resized while it is used. A DataVECTOR converts implicitly to a view of all its samples.
+ */
+struct DataVIEW {
+    const DataTYPE* data;
+    int offset, length;
+
+    DataVIEW() : data(0), offset(0), length(0) {}
+    DataVIEW(const DataVECTOR& v) : data(v.empty() ? 0 : &v[0]), offset(0), length(int(v.size())) {}
+    DataVIEW(const DataTYPE* d, int off, int n) : data(d), offset(off), length(n) {}
+
+    int size() const { return length; }
+    bool empty() const { return length == 0; }
+    const DataTYPE& operator[](int i) const { return data[offset + i]; }
+    const DataTYPE* begin() const { return data + offset; }
+    const DataTYPE* end() const { return data + offset + length; }
+
+    DataVECTOR to_vector() const { return DataVECTOR(begin(), end()); }
+};
+
+//version of the template generators: increase whenever a generator changes its output
+//so that templates stored in a TemplateCache are not reused
+#define TEMPLATE_GENERATOR_VERSION 3
+
+//samples of offset added at the end of each template for rounding problems
+#define TEMPLATE_PADDING 100
+
 #define REAL(z,i) ((z)[2*(i)])
 #define IMAG(z,i) ((z)[2*(i)+1])
 
 
+/*! work split into independent blocks, see \ref run_blocks
+ */
+class BlockTask {
+public:
+    virtual ~BlockTask() {}
+    virtual void block(int b) = 0;
+};
+
+/*! runs \ref BlockTask::block for the blocks 0 to \param nblocks - 1 on a local thread pool if \param parallel,
+ *  otherwise in order on the calling thread, and returns when all blocks are done
+ */
+void run_blocks(BlockTask& task, int nblocks, bool parallel = true);
+
+/*! flag set by another thread to abort a generation running in the background: generators given a \param cancel
+ *  flag check it between blocks of samples and return early once it is set, leaving the rest of the output undefined
+ */
+typedef volatile bool CancelFlag;
+
+
 /*****************************************************************************************************************
  *
  *      Template Numerics
@@ -34,35 +84,286 @@ void postprocess_template(DataTYPE samp, DataTYPE off, DataTYPE left, DataTYPE r
                           DataVECTOR& v);
 
 
+/*! in-place alternative to \ref postprocess_template: sizes \param v once for the final template of
+ *  \param nbody samples with \param left and \param right seconds of margins and \param npad samples of
+ *  padding, and fills margins and padding with \param off. Returns the position at which a generator
+ *  writes the body (with the offset added), so the template is never copied or reallocated.
+ */
+DataTYPE* prepare_template(DataTYPE samp, DataTYPE off, DataTYPE left, DataTYPE right, int nbody, int npad,
+                           DataVECTOR& v);
+
+
+/*! number of samples of a zap or sin template of duration \param dur [sec] at sample rate \param samp [kHz]
+ */
+int template_length(DataTYPE dur, DataTYPE samp);
+
+
+/*! number of samples \param nl and \param nr of the left and right margins of \param left and \param right
+ *  seconds added by \ref postprocess_template assuming a sample rate of \param samp
+ */
+void template_margins(DataTYPE samp, DataTYPE left, DataTYPE right, int& nl, int& nr);
+
+
+/*! fused version of scaling a template body and \ref postprocess_template: \param v is \param nl samples of
+ *  \param off, then \param scale * \param base + \param off, then \param nr samples of \param off.
+ *  A single pass over the data, used for fast updates of amplitude, offset and margins.
+ */
+void scale_offset_template(const DataVECTOR& base, DataTYPE scale, DataTYPE off, int nl, int nr,
+                           DataVECTOR& v);
+
+/*! fixed point export: \param y is \param scale * \param x rounded to the nearest integer and saturated to
+ *  the int16 range. Returns the number of saturated samples.
+ */
+int convert_to_int16(const DataTYPE* x, int n, double scale, short* y);
+
+
 /*! create a zap stimulus of duration \param dur [sec] assuming a sampling frequency of \param samp [kHz]
  * starting from freq \param f0 to \param f1 [Hz] with amplitude \param amp
+ * The versions taking a pointer write \ref template_length samples with offset \param off added to \param v,
+ * e.g. into the buffer returned by \ref prepare_template
+ * With \param precise the time t = i dt and the phase are computed in double instead of accumulating t in float,
+ * which keeps long zaps in phase (see \ref zap_phase_error). The phase is reduced to [-pi, pi] and rounded to float,
+ * the sines are taken in float block wise as in the float mode.
  */
 bool create_zap(DataTYPE dur, DataTYPE samp,
                             DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse,
-                            DataVECTOR& v );
+                            DataVECTOR& v, bool precise = false );
+
+void create_zap(DataTYPE dur, DataTYPE samp,
+                            DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse,
+                            DataTYPE off, DataTYPE* v, bool precise = false, const CancelFlag* cancel = 0 );
 
 /*! create a zap stimulus of duration \param dur [sec] assuming a sampling frequency of \param samp [kHz]
  * starting from freq \param f0 to \param f1 [Hz] increasing quadratically with amplitude \param amp
  */
 bool create_zap_2(DataTYPE dur, DataTYPE samp,
                             DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse,
-                            DataVECTOR& v );
+                            DataVECTOR& v, bool precise = false );
+
+void create_zap_2(DataTYPE dur, DataTYPE samp,
+                            DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse,
+                            DataTYPE off, DataTYPE* v, bool precise = false, const CancelFlag* cancel = 0 );
 
 /*! create a zap stimulus of duration \param dur [sec] assuming a sampling frequency of \param samp [kHz]
  * starting from freq \param f0 to \param f1 [Hz] increasing exponentially with amplitude \param amp
  */
 bool create_zap_exp(DataTYPE dur, DataTYPE samp,
                             DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse,
-                            DataVECTOR& v );
+                            DataVECTOR& v, bool precise = false );
+
+void create_zap_exp(DataTYPE dur, DataTYPE samp,
+                            DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse,
+                            DataTYPE off, DataTYPE* v, bool precise = false, const CancelFlag* cancel = 0 );
+
+/*! error [rad] of the phase of a zap of \param type (0 linear, 1 squared, 2 exponential) created with or
+ *  without \param precise, measured against a long double reference using exact times t = i dt at \param nprobe
+ *  samples spread over the zap including its last sample. For the precise mode the result is never below
+ *  the double rounding bound of the phase plus the float rounding of the reduced phase, so it is a bound also
+ *  where long double equals double. For the float mode it is an estimate only: the accumulated drift is largest
+ *  near the end, but between the probes the error can exceed it.
+ */
+double zap_phase_error(int type, DataTYPE dur, DataTYPE samp, DataTYPE f0, DataTYPE f1, bool reverse,
+                       bool precise, int nprobe = 1000);
+
+
+/*! polyphase FIR interpolator raising the sampling rate by an integer \param factor: Kaiser windowed sinc
+ *  (shape \param beta) spanning \param taps (even) low rate samples with cutoff at the low rate Nyquist frequency.
+ *  The filter is interpolating, every factor-th output sample equals an input sample. The defaults are tuned
+ *  for signals within a quarter of the low rate Nyquist frequency (\ref multirate_factor), where the error
+ *  stays at the float resolution.
+ */
+class Interpolator {
+public:
+    Interpolator(int factor, int taps = 16, double beta = 17.0);
+
+    int factor() const { return L; }
+    int taps() const { return K; }
+
+    /*! number of low rate samples needed for \param n output samples, see \ref upsample
+     */
+    int input_length(int n) const { return (n - 1) / L + 1 + K; }
+
+    /*! writes \param n output samples with offset \param off added to \param v, output m is at low rate position
+     *  m / factor; \param x holds the low rate positions -taps/2 to (n-1)/factor + taps/2, i.e. x[taps/2] is
+     *  at position 0. The outputs of each low rate sample are computed together, so the inner loop is a plain
+     *  vector update over contiguous outputs.
+     */
+    void upsample(const double* x, int n, DataTYPE off, DataTYPE* v) const;
+
+    /*! bound of the error relative to the amplitude for signals band limited to the fraction \param band of
+     *  the low rate Nyquist frequency: maximal passband deviation plus the maximal gains of all images
+     */
+    double error_bound(double band) const;
+
+private:
+    int L, K;
+    std::vector<double> coef;   // L phases of K+1 coefficients
+    std::vector<double> coef_t; // the same tap major
+    std::vector<double> kernel; // impulse response at the high rate, centered
+};
+
+/*! reduction factor of the sampling rate for stimuli band limited to \param fmax [Hz] at sampling frequency
+ *  \param samp [kHz]: the low rate keeps at least 8 fmax, at most 64, 1 if it does not pay off
+ */
+int multirate_factor(DataTYPE samp, DataTYPE fmax);
+
+/*! error bound of \ref create_zap_multirate relative to the amplitude, not counting the float rounding of the output
+ */
+double multirate_error(int factor, DataTYPE samp, DataTYPE fmax);
+
+/*! zap of \param type (0 linear, 1 squared, 2 exponential) as with precise phase, but synthesized at the rate
+ *  samp / \param factor and upsampled by \ref Interpolator, which cuts the sin() evaluations by the factor.
+ *  The error is bounded by \ref multirate_error times the amplitude.
+ */
+void create_zap_multirate(int type, DataTYPE dur, DataTYPE samp,
+                          DataTYPE f0, DataTYPE f1, DataTYPE amp, bool reverse, int factor,
+                          DataTYPE off, DataTYPE* v, const CancelFlag* cancel = 0);
+
+/*! shape of the noise spectrum within the band of \ref create_noise: flat (default), a power spectrum
+ *  ~ 1/f^\ref alpha (1 pink, 2 brown noise) or a power spectral density table \ref psd_f [Hz], \ref psd that
+ *  is interpolated linearly and continued constantly beyond its ends. The table is used if not empty.
+ *  Only the relative power matters, the noise is normalized to its standard deviation afterwards.
+ */
+class NoiseShape {
+public:
+    NoiseShape();
+
+    double alpha;
+    std::vector<double> psd_f, psd;
+
+    bool flat() const;
+
+    /*! reads the table from a text file with lines "f psd" of increasing f, lines starting with # are skipped
+     */
+    bool read_psd(const std::string& file_name);
+
+    /*! magnitudes \param m of the first \param nbins bins of spacing \param df [Hz], m[0] = 0
+     */
+    void magnitudes(double df, int nbins, double* m) const;
+};
+
 
 /*! create a noise stimulus of duration \param dur [sec] assuming a sampling frequency of \param samp [kHz]
  * with uniform frequency spectrum from \param f0 to \param f1 [Hz] and standard deviation \param sigma
  * added is a LFP like signal with amplitude \param amp and phase \param phase and freqeuncy \\param ff [Hz]
+ * the spectrum within the band can be shaped by \param shape
  */
 bool create_noise(DataTYPE dur, DataTYPE samp,
                               DataTYPE ff,  DataTYPE phase, DataTYPE amp,
                               DataTYPE f0, DataTYPE f1, DataTYPE sigma, int seed,
-                              DataVECTOR& v);
+                              DataVECTOR& v, const NoiseShape* shape = 0);
+
+
+/*! number of samples of a noise template of duration \param dur [sec] at sample rate \param samp [kHz]
+ */
+int noise_length(DataTYPE dur, DataTYPE samp);
+
+
+/*! scratch space of \ref create_noise for templates of duration \param dur [sec] and sampling
+ *  frequency \param samp [kHz]: fft plan and spectrum buffers of the optimized fft size and the number
+ *  \ref n_final of samples kept. A workspace can be reused for many noise templates of the same size,
+ *  but must not be used by two threads at the same time.
+ */
+class NoiseWorkspace {
+public:
+    FFTPlan plan;
+    int n_final;
+    std::vector<double> fft_r, fft_i, fft_out_r, fft_out_i;
+    std::vector<double> mag;
+
+    void setup(DataTYPE dur, DataTYPE samp);
+};
+
+/*! first stage of \ref create_noise: draws the random phases for the bins from \param f0 to \param f1 [Hz]
+ *  using seed \param seed into the spectrum of \param w and applies the magnitudes of \param shape if given.
+ *  Uses rand(), so call it from a single thread only.
+ */
+void create_noise_spectrum(DataTYPE dur, DataTYPE f0, DataTYPE f1, int seed,
+                           NoiseWorkspace& w, const NoiseShape* shape = 0);
+
+/*! second stage of \ref create_noise: transforms the spectrum in \param w, normalizes to standard
+ *  deviation \param sigma and adds the LFP like sine. Thread safe as long as \param w is not shared.
+ *  Two blocked passes: conversion together with mean and variance (block wise two-pass, blocks combined
+ *  by Welford's update), then scaling together with the sine, which is computed by a rotation set exactly
+ *  at each block start instead of one sin() per sample.
+ */
+bool synthesize_noise(DataTYPE samp,
+                      DataTYPE ff,  DataTYPE phase, DataTYPE amp, DataTYPE sigma,
+                      NoiseWorkspace& w, DataVECTOR& v);
+
+/*! in-place version of \ref synthesize_noise: writes the \ref NoiseWorkspace::n_final samples with offset
+ *  \param off added to \param v
+ */
+void synthesize_noise(DataTYPE samp,
+                      DataTYPE ff,  DataTYPE phase, DataTYPE amp, DataTYPE sigma,
+                      DataTYPE off, NoiseWorkspace& w, DataTYPE* v, const CancelFlag* cancel = 0);
+
+
+/*! noise of the same kind as \ref create_noise but of unbounded length with memory independent of the length:
+ *  blocks of \param block samples (default: at least 10 sec) of random phase noise are weighted by a sine window
+ *  and overlap-added with a hop of half a block. Each block is scaled to \param sigma analytically from its
+ *  spectrum, and the squared windows add up to one, so mean and variance are the same everywhere.
+ *  The band is resolved to 1 / block duration and smeared by the window by about as much.
+ *  Uses its own random generator, so streams can run on several threads; the noise differs from the
+ *  one of \ref create_noise for the same seed.
+ */
+class NoiseStream {
+public:
+    NoiseStream(DataTYPE samp,
+                DataTYPE ff,  DataTYPE phase, DataTYPE amp,
+                DataTYPE f0, DataTYPE f1, DataTYPE sigma, int seed,
+                DataTYPE off = 0, const NoiseShape* shape = 0, int block = 0);
+
+    /*! writes the next \param n samples with the LFP like sine and offset added to \param v
+     */
+    void read(DataTYPE* v, int n);
+
+private:
+    DataTYPE dt, ff, phase, amp, f0, f1, sigma, off;
+    NoiseShape shape;
+
+    int nblock, nhop, pos;
+    double count;
+    unsigned int state;
+
+    FFTPlan plan;
+    std::vector<double> window, mag, re, im, out_r, out_i, acc;
+
+    double random();
+    void shift();
+    void next_block();
+};
+
+
+/*! gaussian white noise of \param n samples through the second order IIR filter with coefficients \param b and
+ *  \param a (a[0] = 1), scaled to standard deviation \param sigma with offset \param off added, written to \param v.
+ *  The filter starts in its stationary state (covariance from the discrete Lyapunov equation), so there is no
+ *  transient. The recurrence is evaluated block parallel: each block is filtered from zero state, the block start
+ *  states are propagated by the L-th power of the state matrix and the response to them is added in a second pass.
+ *  The gaussian numbers are drawn by Box-Muller on arrays with a random generator per block, so the noise does not
+ *  depend on the number of threads; it differs from the one of \ref create_noise for the same seed.
+ */
+void create_iir_noise(int n, const double b[3], const double a[3], DataTYPE sigma, int seed,
+                      DataTYPE off, DataTYPE* v, bool parallel = true, const CancelFlag* cancel = 0);
+
+/*! Ornstein-Uhlenbeck noise of duration \param dur [sec] at sampling frequency \param samp [kHz] with correlation
+ *  time \param tau [ms] and stationary standard deviation \param sigma, by the exact update
+ *  x_n = exp(-dt/tau) x_n-1 + sqrt(1 - exp(-2dt/tau)) sigma xi_n, see \ref create_iir_noise
+ */
+bool create_ou_noise(DataTYPE dur, DataTYPE samp, DataTYPE tau, DataTYPE sigma, int seed,
+                     DataVECTOR& v);
+
+void create_ou_noise(DataTYPE dur, DataTYPE samp, DataTYPE tau, DataTYPE sigma, int seed,
+                     DataTYPE off, DataTYPE* v, bool parallel = true, const CancelFlag* cancel = 0);
+
+/*! gaussian noise low pass filtered by a second order Butterworth filter of cutoff \param fc [Hz] with standard
+ *  deviation \param sigma, see \ref create_iir_noise
+ */
+bool create_filtered_noise(DataTYPE dur, DataTYPE samp, DataTYPE fc, DataTYPE sigma, int seed,
+                           DataVECTOR& v);
+
+void create_filtered_noise(DataTYPE dur, DataTYPE samp, DataTYPE fc, DataTYPE sigma, int seed,
+                           DataTYPE off, DataTYPE* v, bool parallel = true, const CancelFlag* cancel = 0);
 
 
 /*! create a sin stimulus of duration \param dur [sec] assuming a sampling frequency of \param samp [kHz]
@@ -74,6 +375,77 @@ bool create_sin(DataTYPE dur, DataTYPE samp,
                             bool positive,
                             DataVECTOR& v);
 
+void create_sin(DataTYPE dur, DataTYPE samp,
+                            DataTYPE ff,  DataTYPE phase, DataTYPE amp,
+                            DataTYPE ff2,  DataTYPE phase2, DataTYPE amp2,
+                            bool positive,
+                            DataTYPE off, DataTYPE* v, const CancelFlag* cancel = 0);
+
+
+/*! segment of a piecewise linear stimulus: level \ref level at its start changing by \ref ramp until its end
+ */
+struct StepSegment {
+    double dur;     // duration [sec]
+    double level;   // level at the start
+    double ramp;    // change of the level over the segment, 0 for a step
+
+    StepSegment(double d = 0, double l = 0, double r = 0) : dur(d), level(l), ramp(r) {}
+};
+
+/*! piecewise constant or linear stimulus (current steps, pulse trains, ramps) kept run-length encoded as a list
+ *  of \ref StepSegment and expanded to samples at sampling frequency \param samp [kHz] only where needed, e.g. in
+ *  chunks when written or at the breakpoints when plotted. Segment boundaries are rounded from the accumulated
+ *  time, so many short segments do not drift. Constant protocols map directly onto HEKA sequence segments.
+ */
+class StepProtocol {
+public:
+    StepProtocol(DataTYPE samp = 20);
+
+    void clear();
+
+    /*! appends a segment of duration \param dur [sec], segments of zero duration are ignored
+     */
+    void add(double dur, double level, double ramp = 0);
+
+    /*! \param n pulses of duration \param width [sec] and amplitude \param amp on \param base every \param interval [sec]
+     */
+    void add_pulse_train(int n, double width, double interval, double amp, double base = 0);
+
+    /*! \param n steps of duration \param dur [sec] to \param first + i \param increment, each followed by
+     *  \param rest [sec] at \param base
+     */
+    void add_steps(int n, double dur, double first, double increment, double rest = 0, double base = 0);
+
+    /*! reads segments from a text file with lines "dur level [ramp]", lines starting with # are skipped
+     */
+    bool read(const std::string& file_name);
+
+    const std::vector<StepSegment>& segments() const { return segment; }
+    DataTYPE sample() const { return samp; }
+    int length() const { return start.back(); }
+    double duration() const { return time; }
+
+    /*! true if there are no ramps
+     */
+    bool constant() const;
+
+    /*! writes the samples \param from to \param from + \param n with offset \param off added to \param v,
+     *  samples beyond the end are \param off
+     */
+    void expand(int from, int n, DataTYPE off, DataTYPE* v) const;
+    void expand(DataVECTOR& v) const;
+
+    /*! times \param t [sec] and levels \param y of start and end of all segments, enough to plot the protocol
+     */
+    void breakpoints(std::vector<double>& t, std::vector<double>& y) const;
+
+private:
+    DataTYPE samp;
+    double time;
+    std::vector<StepSegment> segment;
+    std::vector<int> start;  // first sample of each segment, the length at the end
+};
+
 
 
 /*****************************************************************************************************************
@@ -94,37 +466,115 @@ void mean(const DataVECTOR& d1, const DataVECTOR& d2, DataVECTOR& m);
 void reverse_data(DataVECTOR& d);
 
 
-/*! detect position \param p of first value which is not \param zero in \param d1
+/*! detect position \param p of first value which is not \param zero in \param d1, i.e. differs from it by
+ *  more than \param eps. Scans blocks of samples without branches and stops at the first block with a hit.
  */
-void first_non_zero(const DataVECTOR& d1, int& p, const DataTYPE& zero);
+void first_non_zero(const DataVIEW& d1, int& p, const DataTYPE& zero, const DataTYPE& eps = 0);
 
 
-/*! detect position \param p of last value which is not \param zero in \param d1
+/*! detect position \param p of last value which is not \param zero in \param d1 counted from the end,
+ *  i.e. the number of trailing values within \param eps of \param zero
  */
-void last_non_zero(const DataVECTOR& d1, int& p, const DataTYPE& zero);
+void last_non_zero(const DataVIEW& d1, int& p, const DataTYPE& zero, const DataTYPE& eps = 0);
 
 
-/*! removes \param n1 elements in the front and \param n2 in the end of \param d1
+/*! removes \param n1 elements in the front and \param n2 in the end of \param d1,
+ *  for a view without copying
  */
 void remove_ends(DataVECTOR& d1, int n1, int n2);
+void remove_ends(DataVIEW& d1, int n1, int n2);
 
 
 /*! smooth data \param d1 by calculating averages in bins of width \param width
  */
-void smooth_data(DataVECTOR& data, const int& width, DataVECTOR& smooth);
+void smooth_data(const DataVIEW& data, const int& width, DataVECTOR& smooth);
 
 
 /*! peak detection algorithm by Tods and Andrews
  *  finds first \param nmax positions of peaks of height \param threshld in \param data
  *  and stores their poisiton in \param peaks
  */
-void find_peaks(const DataVECTOR& data, const DataTYPE& threshold, std::vector<int>& peaks, int nmax);
+void find_peaks(const DataVIEW& data, const DataTYPE& threshold, std::vector<int>& peaks, int nmax);
+
+
+/*! \ref find_peaks for long recordings, e.g. spike detection at full sampling rate, with the same result.
+ *  Chunks are scanned in parallel starting from a guessed detector state. The true state is then carried
+ *  into each chunk until it agrees with the state of the guess after a peak or at a checkpoint, from there
+ *  on the peaks of the chunk are taken over. Chunks that never agree are rescanned completely.
+ *  All chunks are scanned, \param nmax only limits the result. Debug builds compare every result of
+ *  more than one chunk (2^18 samples) with \ref find_peaks.
+ */
+void find_peaks_parallel(const DataVIEW& data, const DataTYPE& threshold, std::vector<int>& peaks, int nmax,
+                         bool parallel = true);
 
 
 /*! impedance of response \param out to input \param in, i.e.
- * |\param z = fft(out)|/|fft(in)|^2
+ * \param z = |fft(out)|^2/|fft(in)|^2 for the n/2+1 non-redundant frequencies of the n samples of \param in,
+ * see \ref ImpedanceSpectrum
+ */
+void impedance(const DataVIEW& in, const DataVIEW& out, DataVECTOR& z);
+
+
+/*! Complex impedance Z = fft(out)/fft(in) for the frequencies k/n, k = 0..n/2, of n samples. Real signals
+ *  of even length are transformed by one complex fft of half the length. The spectrum of the stimulus is
+ *  kept and only recomputed if a different stimulus is set, so repeated sweeps of the same template
+ *  transform only their response. Plan and buffers are reused as long as the length does not change.
+ */
+class ImpedanceSpectrum {
+public:
+    ImpedanceSpectrum() : n(0) {}
+
+    /*! sets the stimulus \param in, returns false if its spectrum was taken from the last call
+     */
+    bool set_stimulus(const DataVIEW& in);
+
+    int size() const { return n; }
+    int frequencies() const { return n / 2 + 1; }
+
+    /*! impedance of the response \param out (at least \ref size samples) as magnitude \param magnitude
+     *  and phase \param phase in [-pi, pi], one value per frequency. Frequencies without stimulus power give 0.
+     */
+    void response(const DataVIEW& out, DataVECTOR& magnitude, DataVECTOR& phase);
+
+    /*! squared magnitude |Z|^2 of the impedance of \param out only
+     */
+    void response(const DataVIEW& out, DataVECTOR& z2);
+
+private:
+    int n;
+    FFTPlan plan;
+    DataVECTOR stimulus;
+    std::vector<double> in_r, in_i;                 // stimulus spectrum
+    std::vector<double> out_r, out_i;               // response spectrum
+    std::vector<double> x_r, x_i, y_r, y_i;         // fft scratch
+    std::vector<double> tw_r, tw_i;                 // twiddles of the real fft
+
+    void setup(int n);
+    void transform(const DataVIEW& x, std::vector<double>& re, std::vector<double>& im);
+};
+
+
+/*! Result of \ref fit_resonance: resonator model
+ *  z(f) = amp / ((1 - (f/f0)^2)^2 + (f/(q f0))^2)
+ *  of the squared impedance \ref impedance, i.e. a damped second order system with natural frequency f0 and
+ *  quality q. Errors are standard errors from the covariance of the fit.
+ */
+struct ResonanceFit {
+    double amp, f0, q, q_err;
+    double fres, fres_err;  // frequency of the impedance maximum [Hz], 0 without resonance (q <= 1/sqrt(2))
+    double r2;              // fraction of the variance of log z explained by the model
+    int iterations;
+    bool valid;
+
+    ResonanceFit() : amp(0), f0(0), q(0), q_err(0), fres(0), fres_err(0), r2(0), iterations(0), valid(false) {}
+};
+
+/*! fits the resonator model of \ref ResonanceFit to the squared impedance \param z with sample i at frequency
+ *  \param f_first + i * \param df [Hz] by Levenberg-Marquardt on log z. If \param warm and \param fit is
+ *  valid the fit starts from \param fit, e.g. the fit of the last recording, otherwise from a guess by the
+ *  maximum of \param z. Returns false if the fit did not converge.
  */
-void impedance(const DataVECTOR& in, const DataVECTOR& out, DataVECTOR& z);
+bool fit_resonance(const DataVIEW& z, double f_first, double df, ResonanceFit& fit, bool warm = true);
 
 
 #endif // NUMERICS_H
@@ -0,0 +1,185 @@
+/*****************************************************************************************************************
+
+    Smoothing: boxcar, moving average, Gaussian and Savitzky-Golay smoothing of analysis data, e.g. impedances
+
+    Author: Christoph Kirst (ckirst@nld.ds.mpg.de)
+    Date:   2012, LMU Munich
+
+ *****************************************************************************************************************/
+
+#include "smoothing.h"
+
+#include <cmath>
+#include <algorithm>
+
+
+/*****************************************************************************************************************
+ *
+ *      Sums
+ *
+ *****************************************************************************************************************/
+
+void prefix_sums(const DataVIEW& x, std::vector<double>& s) {
+    int n = x.size();
+    s.resize(n + 1);
+    double sum = 0;
+    s[0] = 0;
+    for (int i = 0; i < n; i++) {
+        sum += x[i];
+        s[i+1] = sum;
+    }
+}
+
+// centered average over 2 half + 1 samples clipped at the ends, in and out may not overlap
+static void moving_average(const double* in, int n, int half, double* out, std::vector<double>& s) {
+    s.resize(n + 1);
+    s[0] = 0;
+    for (int i = 0; i < n; i++) s[i+1] = s[i] + in[i];
+
+    for (int i = 0; i < n; i++) {
+        int a = std::max(i - half, 0);
+        int b = std::min(i + half + 1, n);
+        out[i] = (s[b] - s[a]) / (b - a);
+    }
+}
+
+
+/*****************************************************************************************************************
+ *
+ *      Windows
+ *
+ *****************************************************************************************************************/
+
+void smooth_boxcar(const DataVIEW& x, int width, DataVECTOR& y) {
+    int n = x.size();
+    if (width < 1) width = 1;
+    int nb = (n + width - 1) / width;
+    y.resize(nb);
+
+    const DataTYPE* d = x.begin();
+    for (int b = 0; b < nb; b++) {
+        int k0 = b * width;
+        int k1 = std::min(k0 + width, n);
+        double sum = 0;
+        for (int k = k0; k < k1; k++) sum += d[k];
+        y[b] = sum / (k1 - k0);
+    }
+}
+
+void smooth_moving_average(const DataVIEW& x, int width, DataVECTOR& y) {
+    int n = x.size();
+    std::vector<double> s;
+    prefix_sums(x, s);
+
+    int half = std::max(width, 1) / 2;
+    y.resize(n);
+    for (int i = 0; i < n; i++) {
+        int a = std::max(i - half, 0);
+        int b = std::min(i + half + 1, n);
+        y[i] = (s[b] - s[a]) / (b - a);
+    }
+}
+
+void smooth_gaussian(const DataVIEW& x, double sigma, DataVECTOR& y) {
+    int n = x.size();
+    y.resize(n);
+    if (n == 0) return;
+
+    std::vector<double> a(x.begin(), x.end()), b(n), s;
+    if (sigma <= 0) {
+        std::copy(a.begin(), a.end(), y.begin());
+        return;
+    }
+
+    // odd box widths wl, wl + 2 whose three fold convolution has variance sigma^2
+    const int passes = 3;
+    double wideal = sqrt(12.0 * sigma * sigma / passes + 1);
+    int wl = int(floor(wideal));
+    if (wl % 2 == 0) wl--;
+    int wu = wl + 2;
+    int m = int(floor((12.0 * sigma * sigma - passes * wl * wl - 4.0 * passes * wl - 3.0 * passes)
+                      / (-4.0 * wl - 4) + 0.5));
+
+    for (int p = 0; p < passes; p++) {
+        int w = p < m ? wl : wu;
+        moving_average(&a[0], n, w / 2, &b[0], s);
+        a.swap(b);
+    }
+
+    for (int i = 0; i < n; i++) y[i] = a[i];
+}
+
+void smooth_savitzky_golay(const DataVIEW& x, int width, DataVECTOR& y) {
+    int n = x.size();
+    y.resize(n);
+    if (n == 0) return;
+
+    const DataTYPE* d = x.begin();
+    int m = std::max(width, 1) / 2;
+    if (2 * m + 1 > n) m = (n - 1) / 2;
+    if (m < 1) {
+        std::copy(d, d + n, y.begin());
+        return;
+    }
+
+    // moments of the window sums S_j = sum_k k^j x[i+k], k = -m..m
+    double nw = 2 * m + 1;
+    double k2 = m * (m + 1.0) * (2 * m + 1) / 3;
+    double k4 = k2 * (3.0 * m * m + 3 * m - 1) / 5;
+    double det = nw * k4 - k2 * k2;
+
+    // the window sums slide in O(1) per sample, recomputed once per window length to bound the round off
+    double s0 = 0, s1 = 0, s2 = 0;
+    int resync = 2 * m + 1;
+    for (int i = m; i < n - m; i++) {
+        if ((i - m) % resync == 0) {
+            s0 = s1 = s2 = 0;
+            for (int k = -m; k <= m; k++) {
+                double v = d[i+k];
+                s0 += v;
+                s1 += k * v;
+                s2 += double(k) * k * v;
+            }
+        } else {
+            double out = d[i-m-1], in = d[i+m];
+            // shift the window center by one: k -> k - 1
+            s2 = s2 - 2 * s1 + s0 - (m + 1.0) * (m + 1.0) * out + double(m) * m * in;
+            s1 = s1 - s0 + (m + 1.0) * out + m * in;
+            s0 = s0 - out + in;
+        }
+
+        double a0 = (k4 * s0 - k2 * s2) / det;
+        y[i] = a0;
+
+        // ends: the polynomial of the first and last full window
+        if (i == m || i == n - m - 1) {
+            double a1 = s1 / k2;
+            double a2 = (nw * s2 - k2 * s0) / det;
+            int j0 = (i == m) ? 0 : i + 1;
+            int j1 = (i == m) ? m : n;
+            for (int j = j0; j < j1; j++) {
+                double k = j - i;
+                y[j] = a0 + a1 * k + a2 * k * k;
+            }
+        }
+    }
+}
+
+int smooth(const DataVIEW& x, int window, int width, DataVECTOR& y) {
+    if (width < 1) width = 1;
+
+    switch (window) {
+        case SmoothMovingAverage:
+            smooth_moving_average(x, width, y);
+            return 1;
+        case SmoothGaussian:
+            smooth_gaussian(x, width / 2.0, y);
+            return 1;
+        case SmoothSavitzkyGolay:
+            smooth_savitzky_golay(x, width, y);
+            return 1;
+        default:
+            smooth_boxcar(x, width, y);
+            return width;
+    }
+}
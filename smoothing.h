@@ -0,0 +1,59 @@
+/*****************************************************************************************************************
+
+    Smoothing: boxcar, moving average, Gaussian and Savitzky-Golay smoothing of analysis data, e.g. impedances
+
+    Author: Christoph Kirst (ckirst@nld.ds.mpg.de)
+    Date:   2012, LMU Munich
+
+ *****************************************************************************************************************/
+
+#ifndef SMOOTHING_H
+#define SMOOTHING_H
+
+#include <vector>
+
+#include "numerics.h"
+
+
+/*! smoothing windows of \ref smooth
+ */
+enum SmoothWindow {SmoothBoxcar = 0, SmoothMovingAverage, SmoothGaussian, SmoothSavitzkyGolay};
+
+
+/*! \param s [i] = sum of the first i samples of \param x, \param s has one element more than \param x
+ */
+void prefix_sums(const DataVIEW& x, std::vector<double>& s);
+
+
+/*! decimating boxcar: averages of \param x in consecutive bins of \param width samples, the last bin may be
+ *  shorter. Same result as \ref smooth_data
+ */
+void smooth_boxcar(const DataVIEW& x, int width, DataVECTOR& y);
+
+
+/*! centered moving average of \param x over 2 * (\param width / 2) + 1 samples, near the ends over the
+ *  samples available
+ */
+void smooth_moving_average(const DataVIEW& x, int width, DataVECTOR& y);
+
+
+/*! Gaussian smoothing of \param x with standard deviation \param sigma samples, approximated by three
+ *  moving averages
+ */
+void smooth_gaussian(const DataVIEW& x, double sigma, DataVECTOR& y);
+
+
+/*! Savitzky-Golay smoothing of \param x: value at the center of a quadratic least squares fit over
+ *  2 * (\param width / 2) + 1 samples. Near the ends the fit of the first and last full window is used.
+ */
+void smooth_savitzky_golay(const DataVIEW& x, int width, DataVECTOR& y);
+
+
+/*! smooths \param x with the \ref SmoothWindow \param window of \param width samples, the Gaussian has standard
+ *  deviation \param width / 2. Returns the decimation of \param y, i.e. \param width for the boxcar, 1 otherwise.
+ *  All windows cost O(n) independent of \param width.
+ */
+int smooth(const DataVIEW& x, int window, int width, DataVECTOR& y);
+
+
+#endif // SMOOTHING_H
@@ -0,0 +1,301 @@
+/*****************************************************************************************************************
+
+    Template Cache: content addressed on-disk / memory-mapped store of created templates
+
+    Author: Christoph Kirst (ckirst@nld.ds.mpg.de)
+    Date:   2012, LMU Munich
+
+ *****************************************************************************************************************/
+
+#include "templatecache.h"
+
+#include "debug.h"
+
+#include <QCryptographicHash>
+#include <QMutexLocker>
+#include <QFileInfo>
+#include <QDir>
+
+#include <algorithm>
+
+
+/*****************************************************************************************************************
+ *
+ *      Template Cache
+ *
+ *****************************************************************************************************************/
+
+CachedTemplate::CachedTemplate() : cache(NULL) {}
+
+CachedTemplate::CachedTemplate(const CachedTemplate& t) : cache(NULL) {
+    *this = t;
+}
+
+CachedTemplate& CachedTemplate::operator=(const CachedTemplate& t) {
+    if (this == &t) return *this;
+    release();
+    if (t.cache) {
+        QMutexLocker lock(&t.cache->mutex);
+        TemplateCache::Entry* e = t.cache->find(t.key);
+        if (e) e->pins++;
+    }
+    cache = t.cache;
+    key = t.key;
+    data = t.data;
+    return *this;
+}
+
+CachedTemplate::~CachedTemplate() {
+    release();
+}
+
+void CachedTemplate::release() {
+    if (cache) cache->unpin(key);
+    cache = NULL;
+    key.clear();
+    data = DataVIEW();
+}
+
+
+TemplateCache::TemplateCache() : max_mapped(16), max_disk(qint64(1) << 30), disk_used(0) {
+    set_directory(QDir(QDir::tempPath()).filePath("TemplateCreatorCache"));
+}
+
+TemplateCache::~TemplateCache() {
+    unmap(true);
+}
+
+void TemplateCache::set_directory(const QString& dir) {
+    QMutexLocker lock(&mutex);
+    unmap(false);
+    directory = dir;
+    QDir().mkpath(directory);
+    scan();
+}
+
+void TemplateCache::set_limits(int nmapped, qint64 disk_bytes) {
+    QMutexLocker lock(&mutex);
+    max_mapped = nmapped;
+    max_disk = disk_bytes;
+}
+
+
+QString TemplateCache::key(const QString& description) {
+    QString str = QString("TemplateCreator generator %1\n%2").arg(TEMPLATE_GENERATOR_VERSION).arg(description);
+    return QString(QCryptographicHash::hash(str.toUtf8(), QCryptographicHash::Sha1).toHex());
+}
+
+QString TemplateCache::file_name(const QString& key) const {
+    return QDir(directory).filePath(key + ".tpl");
+}
+
+
+// mapped entry of key or NULL, lock has to be held
+TemplateCache::Entry* TemplateCache::find(const QString& key) {
+    for (std::list<Entry>::iterator it = mapped.begin(); it != mapped.end(); it++) {
+        if (it->key == key) return &(*it);
+    }
+    return NULL;
+}
+
+// map file of key and move it to the front, lock has to be held
+TemplateCache::Entry* TemplateCache::map(const QString& key) {
+    for (std::list<Entry>::iterator it = mapped.begin(); it != mapped.end(); it++) {
+        if (it->key == key) {
+            mapped.splice(mapped.begin(), mapped, it);
+            return &mapped.front();
+        }
+    }
+
+    QFile* file = new QFile(file_name(key));
+    if (!file->open(QIODevice::ReadOnly)) {
+        delete file;
+        return NULL;
+    }
+
+    Entry e;
+    e.key = key;
+    e.file = file;
+    e.size = file->size() / sizeof(DataTYPE);
+    e.data = NULL;
+    e.pins = 0;
+    if (e.size > 0) {
+        e.data = (const DataTYPE*) file->map(0, e.size * sizeof(DataTYPE));
+        if (e.data == NULL) {
+            delete file;
+            return NULL;
+        }
+    }
+
+    mapped.push_front(e);
+
+    // unmap the least recently used entries that are not pinned
+    int n = int(mapped.size());
+    std::list<Entry>::iterator it = mapped.end();
+    while (n > max_mapped && it != mapped.begin()) {
+        it--;
+        if (it->pins > 0 || it == mapped.begin()) continue;
+        if (it->data) it->file->unmap((uchar*) it->data);
+        delete it->file;
+        it = mapped.erase(it);
+        n--;
+    }
+
+    return &mapped.front();
+}
+
+// unmap all entries, the pinned ones only if pinned is set, lock has to be held
+void TemplateCache::unmap(bool pinned) {
+    for (std::list<Entry>::iterator it = mapped.begin(); it != mapped.end(); ) {
+        if (it->pins > 0 && !pinned) {
+            it++;
+            continue;
+        }
+        if (it->data) it->file->unmap((uchar*) it->data);
+        delete it->file;
+        it = mapped.erase(it);
+    }
+}
+
+// list the files of the directory, newest first, lock has to be held
+void TemplateCache::scan() {
+    used.clear();
+    used_index.clear();
+    disk_used = 0;
+
+    QFileInfoList files = QDir(directory).entryInfoList(QStringList("*.tpl"), QDir::Files, QDir::Time);
+    for (int i = 0; i < files.size(); i++) {
+        File f;
+        f.key = files[i].completeBaseName();
+        f.bytes = files[i].size();
+        used_index[f.key] = used.insert(used.end(), f);
+        disk_used += f.bytes;
+    }
+}
+
+// mark the file of key as most recently used, lock has to be held
+void TemplateCache::touch(const QString& key) {
+    std::map<QString, std::list<File>::iterator>::iterator it = used_index.find(key);
+    if (it != used_index.end()) used.splice(used.begin(), used, it->second);
+}
+
+// drop the file of key from the disk usage, lock has to be held
+void TemplateCache::forget(const QString& key) {
+    std::map<QString, std::list<File>::iterator>::iterator it = used_index.find(key);
+    if (it == used_index.end()) return;
+    disk_used -= it->second->bytes;
+    used.erase(it->second);
+    used_index.erase(it);
+}
+
+void TemplateCache::unpin(const QString& key) {
+    QMutexLocker lock(&mutex);
+    Entry* e = find(key);
+    if (e && e->pins > 0) e->pins--;
+}
+
+
+bool TemplateCache::contains(const QString& key) {
+    QMutexLocker lock(&mutex);
+    return QFileInfo(file_name(key)).exists();
+}
+
+bool TemplateCache::lookup(const QString& key, CachedTemplate& t) {
+    t.release();
+
+    QMutexLocker lock(&mutex);
+    Entry* e = map(key);
+    if (e == NULL) {
+        forget(key);
+        return false;
+    }
+
+    DEBUG("TemplateCache hit")
+    touch(key);
+    e->pins++;
+    t.cache = this;
+    t.key = key;
+    t.data = DataVIEW(e->data, 0, int(e->size));
+    return true;
+}
+
+bool TemplateCache::lookup(const QString& key, DataVECTOR& v) {
+    CachedTemplate t;
+    if (!lookup(key, t)) return false;
+    v.assign(t.view().begin(), t.view().end());
+    return true;
+}
+
+bool TemplateCache::copy(const QString& key, const QString& fname) {
+    QMutexLocker lock(&mutex);
+    QString src = file_name(key);
+    if (!QFileInfo(src).exists()) {
+        forget(key);
+        return false;
+    }
+    touch(key);
+
+    if (QFileInfo(fname).exists()) QFile::remove(fname);
+    return QFile::copy(src, fname);
+}
+
+
+void TemplateCache::insert(const QString& key, const DataVECTOR& v) {
+    QMutexLocker lock(&mutex);
+
+    QString fname = file_name(key);
+    if (QFileInfo(fname).exists()) return;
+
+    //write to temporary file first so that a cache file is always complete
+    QFile file(fname + ".part");
+    if (!file.open(QIODevice::WriteOnly)) return;
+    qint64 bytes = v.size() * sizeof(DataTYPE);
+    bool suc = v.empty() || (file.write((const char*) &v[0], bytes) == bytes);
+    file.close();
+
+    if (!suc || !file.rename(fname)) {
+        file.remove();
+        return;
+    }
+
+    forget(key);
+    File f;
+    f.key = key;
+    f.bytes = bytes;
+    used.push_front(f);
+    used_index[key] = used.begin();
+    disk_used += bytes;
+
+    prune();
+}
+
+void TemplateCache::clear() {
+    QMutexLocker lock(&mutex);
+    unmap(false);
+
+    // pinned templates are still in use and stay
+    QFileInfoList files = QDir(directory).entryInfoList(QStringList("*.tpl"), QDir::Files);
+    for (int i = 0; i < files.size(); i++) {
+        if (find(files[i].completeBaseName())) continue;
+        QFile::remove(files[i].absoluteFilePath());
+    }
+    scan();
+}
+
+
+// remove least recently used files until the cache fits into max_disk, mapped ones are in use and stay,
+// lock has to be held
+void TemplateCache::prune() {
+    std::list<File>::iterator it = used.end();
+    while (disk_used > max_disk && it != used.begin()) {
+        it--;
+        if (find(it->key)) continue;
+
+        QString fname = file_name(it->key);
+        if (!QFile::remove(fname) && QFileInfo(fname).exists()) continue;
+
+        disk_used -= it->bytes;
+        used_index.erase(it->key);
+        it = used.erase(it);
+    }
+}
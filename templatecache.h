@@ -0,0 +1,129 @@
+/*****************************************************************************************************************
+
+    Template Cache: content addressed on-disk / memory-mapped store of created templates
+
+    Author: Christoph Kirst (ckirst@nld.ds.mpg.de)
+    Date:   2012, LMU Munich
+
+ *****************************************************************************************************************/
+
+#ifndef TEMPLATECACHE_H
+#define TEMPLATECACHE_H
+
+#include <QString>
+#include <QFile>
+#include <QMutex>
+
+#include <list>
+#include <map>
+
+#include "numerics.h"
+
+
+class TemplateCache;
+
+/*! template found by \ref TemplateCache::lookup: a view of the memory-mapped cache file. The mapping is pinned while
+ *  a CachedTemplate refers to it, so it is neither unmapped nor removed from the cache meanwhile. Copies share the
+ *  pin, which is released by the last one; none may outlive the cache.
+ */
+class CachedTemplate {
+public:
+    CachedTemplate();
+    CachedTemplate(const CachedTemplate& t);
+    CachedTemplate& operator=(const CachedTemplate& t);
+    ~CachedTemplate();
+
+    const DataVIEW& view() const { return data; }
+    bool valid() const { return cache != NULL; }
+
+    void release();
+
+private:
+    friend class TemplateCache;
+    TemplateCache* cache;
+    QString key;
+    DataVIEW data;
+};
+
+/*! Cache of created templates keyed by a hash of the generator parameters and \ref TEMPLATE_GENERATOR_VERSION.
+ *  Templates are stored as binary template files in \ref directory so a hit can be copied to a HEKA template file
+ *  directly; the most recently used entries are kept memory-mapped. The size of the directory is tracked while
+ *  files are added and the least recently used files are removed beyond the limit; the directory is listed only
+ *  when it is set, which orders its files by modification time. All methods are thread safe.
+ */
+class TemplateCache {
+public:
+    TemplateCache();
+    ~TemplateCache();
+
+    void set_directory(const QString& dir);
+    QString get_directory() const { return directory; }
+
+    /*! maximal number of memory-mapped entries and maximal size of the cache directory in bytes
+     */
+    void set_limits(int nmapped, qint64 disk_bytes);
+
+    /*! key for a template described by \param description (all parameter that determine the template)
+     */
+    static QString key(const QString& description);
+
+    bool contains(const QString& key);
+
+    /*! on a hit sets \param t to the mapped template without reading or copying it
+     */
+    bool lookup(const QString& key, CachedTemplate& t);
+
+    /*! on a hit copies the mapped template into \param v
+     */
+    bool lookup(const QString& key, DataVECTOR& v);
+
+    /*! on a hit writes the template to the template file \param file_name without loading it
+     */
+    bool copy(const QString& key, const QString& file_name);
+
+    void insert(const QString& key, const DataVECTOR& v);
+
+    void clear();
+
+private:
+    friend class CachedTemplate;
+
+    // a memory-mapped template file, pinned by pins CachedTemplates
+    struct Entry {
+        QString key;
+        QFile* file;
+        const DataTYPE* data;
+        qint64 size;
+        int pins;
+    };
+
+    QString directory;
+    int max_mapped;
+    qint64 max_disk;
+
+    std::list<Entry> mapped;  // most recently used first
+    QMutex mutex;
+
+    // a cache file and its size in bytes
+    struct File {
+        QString key;
+        qint64 bytes;
+    };
+
+    std::list<File> used;     // all cache files, most recently used first
+    std::map<QString, std::list<File>::iterator> used_index;
+    qint64 disk_used;         // total size of the files in used
+
+    QString file_name(const QString& key) const;
+    Entry* find(const QString& key);
+    Entry* map(const QString& key);
+    void unmap(bool pinned);
+    void unpin(const QString& key);
+    void scan();
+    void touch(const QString& key);
+    void forget(const QString& key);
+    void prune();
+};
+
+
+#endif // TEMPLATECACHE_H